@@ -0,0 +1,64 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * AOK ZOE boards for the oxp-sensors EC core.
+ *
+ * The AOK ZOE A1 uses the EC layout of the OneXPlayer mini PRO, with the
+ * PWM in [0-255] and the newer turbo button takeover.
+ *
+ * Copyright (C) 2022 Joaquín I. Aramendía <samsagax@gmail.com>
+ */
+
+#include <linux/dmi.h>
+#include <linux/module.h>
+
+#include "oxp-ec.h"
+
+#define OXP_TURBO_SWITCH_REG		0xF1
+#define OXP_TURBO_TAKE_VAL		0x40
+#define OXP_TURBO_RETURN_VAL		0x00
+
+enum oxp_board {
+	aok_zoe_a1,
+};
+
+static const struct oxp_board_info oxp_boards[] = {
+	[aok_zoe_a1] = {
+		.name = "aok_zoe_a1",
+		.pwm_max = 255,
+		.turbo_reg = OXP_TURBO_SWITCH_REG,
+		.turbo_take_val = OXP_TURBO_TAKE_VAL,
+		.turbo_return_val = OXP_TURBO_RETURN_VAL,
+	},
+};
+
+static const struct dmi_system_id dmi_table[] = {
+	{
+		.matches = {
+			DMI_MATCH(DMI_BOARD_VENDOR, "AOKZOE"),
+			DMI_EXACT_MATCH(DMI_BOARD_NAME, "AOKZOE A1 AR07"),
+		},
+		.driver_data = (void *)aok_zoe_a1,
+	},
+	{
+		.matches = {
+			DMI_MATCH(DMI_BOARD_VENDOR, "AOKZOE"),
+			DMI_EXACT_MATCH(DMI_BOARD_NAME, "AOKZOE A1 Pro"),
+		},
+		.driver_data = (void *)aok_zoe_a1,
+	},
+	{},
+};
+
+static const struct oxp_board_family oxp_aokzoe_family = {
+	.boards = oxp_boards,
+	.nr_boards = ARRAY_SIZE(oxp_boards),
+	.dmi_table = dmi_table,
+};
+
+module_oxp_board_family(oxp_aokzoe_family);
+
+MODULE_DEVICE_TABLE(dmi, dmi_table);
+
+MODULE_AUTHOR("Joaquín Ignacio Aramendía <samsagax@gmail.com>");
+MODULE_DESCRIPTION("AOK ZOE boards for the oxp-sensors EC core");
+MODULE_LICENSE("GPL");
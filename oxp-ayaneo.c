@@ -0,0 +1,86 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Aya Neo boards for the oxp-sensors EC core.
+ *
+ * These boards use [0-100] as PWM range in the EC and have no turbo button
+ * takeover.
+ *
+ * Copyright (C) 2022 Joaquín I. Aramendía <samsagax@gmail.com>
+ */
+
+#include <linux/dmi.h>
+#include <linux/module.h>
+
+#include "oxp-ec.h"
+
+enum oxp_board {
+	aya_neo_2,
+	aya_neo_air,
+	aya_neo_air_pro,
+	aya_neo_geek,
+};
+
+static const struct oxp_board_info oxp_boards[] = {
+	[aya_neo_2] = {
+		.name = "aya_neo_2",
+		.pwm_max = 100,
+	},
+	[aya_neo_air] = {
+		.name = "aya_neo_air",
+		.pwm_max = 100,
+	},
+	[aya_neo_air_pro] = {
+		.name = "aya_neo_air_pro",
+		.pwm_max = 100,
+	},
+	[aya_neo_geek] = {
+		.name = "aya_neo_geek",
+		.pwm_max = 100,
+	},
+};
+
+static const struct dmi_system_id dmi_table[] = {
+	{
+		.matches = {
+			DMI_MATCH(DMI_BOARD_VENDOR, "AYANEO"),
+			DMI_EXACT_MATCH(DMI_BOARD_NAME, "AYANEO 2"),
+		},
+		.driver_data = (void *)aya_neo_2,
+	},
+	{
+		.matches = {
+			DMI_MATCH(DMI_BOARD_VENDOR, "AYANEO"),
+			DMI_EXACT_MATCH(DMI_BOARD_NAME, "AIR"),
+		},
+		.driver_data = (void *)aya_neo_air,
+	},
+	{
+		.matches = {
+			DMI_MATCH(DMI_BOARD_VENDOR, "AYANEO"),
+			DMI_EXACT_MATCH(DMI_BOARD_NAME, "AIR Pro"),
+		},
+		.driver_data = (void *)aya_neo_air_pro,
+	},
+	{
+		.matches = {
+			DMI_MATCH(DMI_BOARD_VENDOR, "AYANEO"),
+			DMI_EXACT_MATCH(DMI_BOARD_NAME, "GEEK"),
+		},
+		.driver_data = (void *)aya_neo_geek,
+	},
+	{},
+};
+
+static const struct oxp_board_family oxp_ayaneo_family = {
+	.boards = oxp_boards,
+	.nr_boards = ARRAY_SIZE(oxp_boards),
+	.dmi_table = dmi_table,
+};
+
+module_oxp_board_family(oxp_ayaneo_family);
+
+MODULE_DEVICE_TABLE(dmi, dmi_table);
+
+MODULE_AUTHOR("Joaquín Ignacio Aramendía <samsagax@gmail.com>");
+MODULE_DESCRIPTION("Aya Neo boards for the oxp-sensors EC core");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,41 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * Interface between the handheld EC core (oxp-sensors) and the board modules
+ * describing the devices it runs on.
+ *
+ * The core owns EC access, batching, caching, background sampling, fan
+ * policies, statistics and the hwmon device. Boards share the fan and PWM
+ * register layout and only differ in the data below, so a board module is a
+ * table of boards and the DMI entries that select them.
+ */
+
+#ifndef _OXP_EC_H
+#define _OXP_EC_H
+
+#include <linux/device/driver.h>
+#include <linux/dmi.h>
+#include <linux/module.h>
+#include <linux/types.h>
+
+struct oxp_board_info {
+	const char *name;
+	int pwm_max;		/* PWM range in the EC is [0-pwm_max] */
+	u8 turbo_reg;		/* 0 if the board has no turbo takeover */
+	u8 turbo_take_val;
+	u8 turbo_return_val;
+};
+
+/* The driver_data of each DMI entry is an index into boards */
+struct oxp_board_family {
+	const struct oxp_board_info *boards;
+	unsigned int nr_boards;
+	const struct dmi_system_id *dmi_table;
+};
+
+int oxp_ec_register_family(const struct oxp_board_family *family);
+void oxp_ec_unregister_family(const struct oxp_board_family *family);
+
+#define module_oxp_board_family(__family) \
+	module_driver(__family, oxp_ec_register_family, oxp_ec_unregister_family)
+
+#endif /* _OXP_EC_H */
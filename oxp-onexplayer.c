@@ -0,0 +1,93 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * OneXPlayer boards for the oxp-sensors EC core.
+ *
+ * Old AMD boards use [0-100] as PWM range in the EC, newer boards like the
+ * mini PRO use [0-255]. The turbo button takeover moved between EC
+ * revisions.
+ *
+ * Copyright (C) 2022 Joaquín I. Aramendía <samsagax@gmail.com>
+ */
+
+#include <linux/dmi.h>
+#include <linux/module.h>
+
+#include "oxp-ec.h"
+
+/* Turbo button takeover function
+ * Older boards have different values and EC registers
+ * for the same function
+ */
+#define OXP_OLD_TURBO_SWITCH_REG	0x1E
+#define OXP_OLD_TURBO_TAKE_VAL		0x01
+#define OXP_OLD_TURBO_RETURN_VAL	0x00
+
+#define OXP_TURBO_SWITCH_REG		0xF1
+#define OXP_TURBO_TAKE_VAL		0x40
+#define OXP_TURBO_RETURN_VAL		0x00
+
+enum oxp_board {
+	oxp_mini_amd,
+	oxp_mini_amd_a07,
+	oxp_mini_amd_pro,
+};
+
+static const struct oxp_board_info oxp_boards[] = {
+	[oxp_mini_amd] = {
+		.name = "oxp_mini_amd",
+		.pwm_max = 100,
+	},
+	[oxp_mini_amd_a07] = {
+		.name = "oxp_mini_amd_a07",
+		.pwm_max = 100,
+		.turbo_reg = OXP_OLD_TURBO_SWITCH_REG,
+		.turbo_take_val = OXP_OLD_TURBO_TAKE_VAL,
+		.turbo_return_val = OXP_OLD_TURBO_RETURN_VAL,
+	},
+	[oxp_mini_amd_pro] = {
+		.name = "oxp_mini_amd_pro",
+		.pwm_max = 255,
+		.turbo_reg = OXP_TURBO_SWITCH_REG,
+		.turbo_take_val = OXP_TURBO_TAKE_VAL,
+		.turbo_return_val = OXP_TURBO_RETURN_VAL,
+	},
+};
+
+static const struct dmi_system_id dmi_table[] = {
+	{
+		.matches = {
+			DMI_MATCH(DMI_BOARD_VENDOR, "ONE-NETBOOK"),
+			DMI_EXACT_MATCH(DMI_BOARD_NAME, "ONE XPLAYER"),
+		},
+		.driver_data = (void *)oxp_mini_amd,
+	},
+	{
+		.matches = {
+			DMI_MATCH(DMI_BOARD_VENDOR, "ONE-NETBOOK"),
+			DMI_EXACT_MATCH(DMI_BOARD_NAME, "ONEXPLAYER mini A07"),
+		},
+		.driver_data = (void *)oxp_mini_amd_a07,
+	},
+	{
+		.matches = {
+			DMI_MATCH(DMI_BOARD_VENDOR, "ONE-NETBOOK"),
+			DMI_EXACT_MATCH(DMI_BOARD_NAME, "ONEXPLAYER Mini Pro"),
+		},
+		.driver_data = (void *)oxp_mini_amd_pro,
+	},
+	{},
+};
+
+static const struct oxp_board_family oxp_onexplayer_family = {
+	.boards = oxp_boards,
+	.nr_boards = ARRAY_SIZE(oxp_boards),
+	.dmi_table = dmi_table,
+};
+
+module_oxp_board_family(oxp_onexplayer_family);
+
+MODULE_DEVICE_TABLE(dmi, dmi_table);
+
+MODULE_AUTHOR("Joaquín Ignacio Aramendía <samsagax@gmail.com>");
+MODULE_DESCRIPTION("OneXPlayer boards for the oxp-sensors EC core");
+MODULE_LICENSE("GPL");
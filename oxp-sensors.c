@@ -1,7 +1,9 @@
 // SPDX-License-Identifier: GPL-2.0+
 /*
- * Platform driver for OneXPlayer, AOK ZOE, and Aya Neo Handhelds that expose
- * fan reading and control via hwmon sysfs.
+ * Platform driver core for OneXPlayer, AOK ZOE, and Aya Neo Handhelds that
+ * expose fan reading and control via hwmon sysfs. The boards themselves are
+ * described by the board modules (oxp-onexplayer, oxp-aokzoe, oxp-ayaneo),
+ * which register them through oxp-ec.h.
  *
  * Old OXP boards have the same DMI strings and they are told apart by
  * the boot cpu vendor (Intel/AMD). Currently only AMD boards are
@@ -16,13 +18,176 @@
  */
 
 #include <linux/acpi.h>
+#include <linux/atomic.h>
+#include <linux/cpufreq.h>
+#include <linux/cpumask.h>
+#include <linux/debugfs.h>
+#include <linux/delay.h>
 #include <linux/dmi.h>
+#include <linux/hrtimer.h>
 #include <linux/hwmon.h>
+#include <linux/hwmon-sysfs.h>
 #include <linux/init.h>
+#include <linux/io.h>
+#include <linux/ioport.h>
 #include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
 #include <linux/module.h>
+#include <linux/notifier.h>
+#include <linux/panic_notifier.h>
+#include <linux/perf_event.h>
 #include <linux/platform_device.h>
 #include <linux/processor.h>
+#include <linux/random.h>
+#include <linux/reboot.h>
+#include <linux/sched.h>
+#include <linux/sched/isolation.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/thermal.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+
+#include <asm/byteorder.h>
+
+#include "oxp-ec.h"
+
+/*
+ * EC transaction statistics. They are only updated on the EC access path and
+ * read back through debugfs, so inspecting them never causes EC traffic.
+ * Latencies are kept in log2 buckets of microseconds: bucket 0 holds
+ * samples under 1us and bucket n holds samples in [2^(n-1), 2^n) us.
+ */
+#define OXP_STATS_BUCKETS	20
+
+struct oxp_latency {
+	atomic64_t total_ns;
+	atomic64_t max_ns;
+	atomic64_t hist[OXP_STATS_BUCKETS];
+};
+
+/* Each EC access is accounted to the register it targets */
+enum oxp_ec_path {
+	OXP_PATH_FAN,
+	OXP_PATH_PWM_ENABLE,
+	OXP_PATH_PWM,
+	OXP_PATH_TURBO,
+	OXP_PATH_OTHER,
+	OXP_PATH_MAX,
+};
+
+static const char * const oxp_ec_path_names[] = {
+	[OXP_PATH_FAN] = "fan",
+	[OXP_PATH_PWM_ENABLE] = "pwm_enable",
+	[OXP_PATH_PWM] = "pwm",
+	[OXP_PATH_TURBO] = "turbo",
+	[OXP_PATH_OTHER] = "other",
+};
+
+/*
+ * Interfaces reading EC values on behalf of userspace. Successful reads are
+ * accounted per interface with their CPU time and the EC bytes they cost,
+ * so the interfaces can be compared under the same workload.
+ */
+enum oxp_iface {
+	OXP_IFACE_HWMON,
+	OXP_IFACE_SNAPSHOT,
+	OXP_IFACE_ATTR,
+	OXP_IFACE_ESTIMATE,
+	OXP_IFACE_MAX,
+};
+
+static const char * const oxp_iface_names[] = {
+	[OXP_IFACE_HWMON] = "hwmon",
+	[OXP_IFACE_SNAPSHOT] = "snapshot",
+	[OXP_IFACE_ATTR] = "attr",
+	[OXP_IFACE_ESTIMATE] = "estimate",
+};
+
+static struct {
+	atomic64_t reads;
+	atomic64_t writes;
+	atomic64_t errors;
+	atomic64_t cache_hits;
+	atomic64_t cache_misses;
+	atomic64_t writes_suppressed;
+	atomic64_t sampler_ticks;
+	atomic64_t ticks_missed;
+	atomic64_t ticks_coalesced;
+	struct oxp_latency lock_wait;
+	struct oxp_latency batch_lat;
+	struct oxp_latency tick_jitter;
+	struct oxp_latency tick_duration;
+	struct oxp_latency read_lat[OXP_PATH_MAX];
+	struct oxp_latency write_lat[OXP_PATH_MAX];
+	struct oxp_latency iface_lat[OXP_IFACE_MAX];
+	atomic64_t iface_ec_reads[OXP_IFACE_MAX];
+} oxp_stats;
+
+static u64 oxp_stats_reset_ns;
+
+/*
+ * The counters exported through the perf PMU must never go backwards, so a
+ * reset leaves them alone and records their value instead, which debugfs
+ * subtracts.
+ */
+static struct {
+	s64 reads;
+	s64 writes;
+	s64 cache_hits;
+	s64 lock_wait_ns;
+} oxp_stats_base;
+
+static bool oxp_stats_monotonic(const atomic64_t *counter)
+{
+	return counter == &oxp_stats.reads || counter == &oxp_stats.writes ||
+	       counter == &oxp_stats.cache_hits ||
+	       counter == &oxp_stats.lock_wait.total_ns;
+}
+
+/* Every member of oxp_stats is an atomic64_t counter */
+static void oxp_stats_reset(void)
+{
+	atomic64_t *counters = (atomic64_t *)&oxp_stats;
+	int i;
+
+	BUILD_BUG_ON(sizeof(oxp_stats) % sizeof(atomic64_t));
+
+	WRITE_ONCE(oxp_stats_base.reads, atomic64_read(&oxp_stats.reads));
+	WRITE_ONCE(oxp_stats_base.writes, atomic64_read(&oxp_stats.writes));
+	WRITE_ONCE(oxp_stats_base.cache_hits,
+		   atomic64_read(&oxp_stats.cache_hits));
+	WRITE_ONCE(oxp_stats_base.lock_wait_ns,
+		   atomic64_read(&oxp_stats.lock_wait.total_ns));
+	for (i = 0; i < sizeof(oxp_stats) / sizeof(atomic64_t); i++) {
+		if (!oxp_stats_monotonic(&counters[i]))
+			atomic64_set(&counters[i], 0);
+	}
+	WRITE_ONCE(oxp_stats_reset_ns, ktime_get_ns());
+}
+
+static void oxp_latency_add(struct oxp_latency *lat, u64 ns)
+{
+	s64 max = atomic64_read(&lat->max_ns);
+	u64 us = div_u64(ns, NSEC_PER_USEC);
+	int bucket = 0;
+
+	if (us)
+		bucket = min_t(int, ilog2(us) + 1, OXP_STATS_BUCKETS - 1);
+
+	atomic64_inc(&lat->hist[bucket]);
+	atomic64_add(ns, &lat->total_ns);
+	while ((s64)ns > max && !atomic64_try_cmpxchg(&lat->max_ns, &max, ns))
+		;
+}
+
+static void oxp_iface_account(enum oxp_iface iface, u64 start)
+{
+	oxp_latency_add(&oxp_stats.iface_lat[iface], ktime_get_ns() - start);
+}
 
 /* Handle ACPI lock mechanism */
 static u32 oxp_mutex;
@@ -31,7 +196,13 @@ static u32 oxp_mutex;
 
 static bool lock_global_acpi_lock(void)
 {
-	return ACPI_SUCCESS(acpi_acquire_global_lock(ACPI_LOCK_DELAY_MS, &oxp_mutex));
+	u64 start = ktime_get_ns();
+	bool locked;
+
+	locked = ACPI_SUCCESS(acpi_acquire_global_lock(ACPI_LOCK_DELAY_MS, &oxp_mutex));
+	oxp_latency_add(&oxp_stats.lock_wait, ktime_get_ns() - start);
+
+	return locked;
 }
 
 static bool unlock_global_acpi_lock(void)
@@ -39,106 +210,284 @@ static bool unlock_global_acpi_lock(void)
 	return ACPI_SUCCESS(acpi_release_global_lock(oxp_mutex));
 }
 
-enum oxp_board {
-	aok_zoe_a1 = 1,
-	aya_neo_2,
-	aya_neo_air,
-	aya_neo_air_pro,
-	aya_neo_geek,
-	oxp_mini_amd,
-	oxp_mini_amd_a07,
-	oxp_mini_amd_pro,
-};
-
-static enum oxp_board board;
-
 /* Fan reading and PWM */
 #define OXP_SENSOR_FAN_REG		0x76 /* Fan reading is 2 registers long */
 #define OXP_SENSOR_PWM_ENABLE_REG	0x4A /* PWM enable is 1 register long */
 #define OXP_SENSOR_PWM_REG		0x4B /* PWM reading is 1 register long */
 
-/* Turbo button takeover function
- * Older boards have different values and EC registers
- * for the same function
+/* Board bound by a board module, see oxp-ec.h */
+static const struct oxp_board_info *board_info;
+
+/*
+ * EC register cache
+ * Every byte read from or written to the EC is remembered together with the
+ * time it was seen. Readers that can live with slightly old data are served
+ * from here instead of doing another EC transaction.
  */
-#define OXP_OLD_TURBO_SWITCH_REG	0x1E
-#define OXP_OLD_TURBO_TAKE_VAL		0x01
-#define OXP_OLD_TURBO_RETURN_VAL	0x00
-
-#define OXP_TURBO_SWITCH_REG		0xF1
-#define OXP_TURBO_TAKE_VAL		0x40
-#define OXP_TURBO_RETURN_VAL		0x00
-
-static const struct dmi_system_id dmi_table[] = {
-	{
-		.matches = {
-			DMI_MATCH(DMI_BOARD_VENDOR, "AOKZOE"),
-			DMI_EXACT_MATCH(DMI_BOARD_NAME, "AOKZOE A1 AR07"),
-		},
-		.driver_data = (void *)aok_zoe_a1,
-	},
-	{
-		.matches = {
-			DMI_MATCH(DMI_BOARD_VENDOR, "AOKZOE"),
-			DMI_EXACT_MATCH(DMI_BOARD_NAME, "AOKZOE A1 Pro"),
-		},
-		.driver_data = (void *)aok_zoe_a1,
-	},
-	{
-		.matches = {
-			DMI_MATCH(DMI_BOARD_VENDOR, "AYANEO"),
-			DMI_EXACT_MATCH(DMI_BOARD_NAME, "AYANEO 2"),
-		},
-		.driver_data = (void *)aya_neo_2,
-	},
-	{
-		.matches = {
-			DMI_MATCH(DMI_BOARD_VENDOR, "AYANEO"),
-			DMI_EXACT_MATCH(DMI_BOARD_NAME, "AIR"),
-		},
-		.driver_data = (void *)aya_neo_air,
-	},
-	{
-		.matches = {
-			DMI_MATCH(DMI_BOARD_VENDOR, "AYANEO"),
-			DMI_EXACT_MATCH(DMI_BOARD_NAME, "AIR Pro"),
-		},
-		.driver_data = (void *)aya_neo_air_pro,
-	},
-	{
-		.matches = {
-			DMI_MATCH(DMI_BOARD_VENDOR, "AYANEO"),
-			DMI_EXACT_MATCH(DMI_BOARD_NAME, "GEEK"),
-		},
-		.driver_data = (void *)aya_neo_geek,
-	},
-	{
-		.matches = {
-			DMI_MATCH(DMI_BOARD_VENDOR, "ONE-NETBOOK"),
-			DMI_EXACT_MATCH(DMI_BOARD_NAME, "ONE XPLAYER"),
-		},
-		.driver_data = (void *)oxp_mini_amd,
+static unsigned int cache_ms;
+module_param(cache_ms, uint, 0644);
+MODULE_PARM_DESC(cache_ms, "Serve sysfs reads from values younger than this (ms, 0 to disable)");
+
+static struct {
+	u8 val;
+	bool valid;
+	unsigned long stamp;
+} oxp_cache[256];
+static DEFINE_SPINLOCK(oxp_cache_lock);
+
+static void oxp_cache_update(u8 reg, u8 val)
+{
+	spin_lock(&oxp_cache_lock);
+	oxp_cache[reg].val = val;
+	oxp_cache[reg].valid = true;
+	oxp_cache[reg].stamp = jiffies;
+	spin_unlock(&oxp_cache_lock);
+}
+
+/* Last value seen for a register, whatever its age */
+static bool oxp_cache_peek(u8 reg, long *val)
+{
+	bool valid;
+
+	spin_lock(&oxp_cache_lock);
+	valid = oxp_cache[reg].valid;
+	*val = valid ? oxp_cache[reg].val : -1;
+	spin_unlock(&oxp_cache_lock);
+
+	return valid;
+}
+
+/* Looks up size registers starting at reg, all seen within max_age jiffies */
+static bool oxp_cache_lookup(u8 reg, int size, unsigned long max_age, long *val)
+{
+	bool hit = true;
+	u8 r;
+	int i;
+
+	*val = 0;
+	spin_lock(&oxp_cache_lock);
+	for (i = 0; i < size && hit; i++) {
+		r = reg + i;
+		hit = oxp_cache[r].valid &&
+		      time_before_eq(jiffies, oxp_cache[r].stamp + max_age);
+		*val = (*val << 8) | oxp_cache[r].val;
+	}
+	spin_unlock(&oxp_cache_lock);
+
+	return hit;
+}
+
+/*
+ * EC transports
+ * By default EC RAM is accessed through the ACPI EC driver, one command
+ * handshake per byte. Boards that also map EC RAM behind an index/data I/O
+ * port pair can be driven directly through those ports, which is much
+ * cheaper per byte; it is opt-in since the pair is board specific. The mock
+ * transport keeps EC RAM in memory and lets the driver load on any machine
+ * as the board named by mock_board, for testing consumers, with optional
+ * per-transaction latency and fault injection. All transports
+ * are used with the ACPI global lock held. Transports that never sleep are
+ * marked atomic and can also be used from panic context.
+ */
+struct oxp_ec_transport {
+	const char *name;
+	int (*read)(u8 reg, u8 *val);
+	int (*write)(u8 reg, u8 val);
+	bool atomic;
+};
+
+static char *ec_transport = "acpi";
+module_param(ec_transport, charp, 0444);
+MODULE_PARM_DESC(ec_transport, "EC access method: acpi, ioport or mock");
+
+static ushort ec_index_port;
+module_param(ec_index_port, ushort, 0444);
+MODULE_PARM_DESC(ec_index_port, "Index port of the EC RAM for the ioport transport");
+
+static ushort ec_data_port;
+module_param(ec_data_port, ushort, 0444);
+MODULE_PARM_DESC(ec_data_port, "Data port of the EC RAM for the ioport transport");
+
+static char *mock_board = "oxp_mini_amd_pro";
+module_param(mock_board, charp, 0444);
+MODULE_PARM_DESC(mock_board, "Board emulated by the mock transport, from a loaded board module");
+
+static int oxp_acpi_read(u8 reg, u8 *val)
+{
+	return ec_read(reg, val);
+}
+
+static int oxp_acpi_write(u8 reg, u8 val)
+{
+	return ec_write(reg, val);
+}
+
+static int oxp_ioport_read(u8 reg, u8 *val)
+{
+	outb(reg, ec_index_port);
+	*val = inb(ec_data_port);
+
+	return 0;
+}
+
+static int oxp_ioport_write(u8 reg, u8 val)
+{
+	outb(reg, ec_index_port);
+	outb(val, ec_data_port);
+
+	return 0;
+}
+
+static unsigned int mock_latency_us;
+module_param(mock_latency_us, uint, 0644);
+MODULE_PARM_DESC(mock_latency_us, "Delay added to each mock EC transaction (us)");
+
+static unsigned int mock_fault_rate;
+module_param(mock_fault_rate, uint, 0644);
+MODULE_PARM_DESC(mock_fault_rate, "Fail one in that many mock EC transactions on average, 0 for never");
+
+/*
+ * The mock fan follows the PWM register with a first order lag, up to
+ * OXP_MOCK_FAN_MAX_RPM at full duty. Its speed is brought up to date
+ * whenever the high byte is read.
+ */
+#define OXP_MOCK_FAN_MAX_RPM	5000
+#define OXP_MOCK_FAN_TAU_MS	1500
+
+static u8 oxp_mock_ram[256];
+static u64 oxp_mock_fan_ns;
+
+static int oxp_mock_transaction(void)
+{
+	unsigned int delay = READ_ONCE(mock_latency_us);
+	unsigned int rate = READ_ONCE(mock_fault_rate);
+
+	if (delay) {
+		mdelay(delay / 1000);
+		udelay(delay % 1000);
+	}
+
+	return rate && !get_random_u32_below(rate) ? -EIO : 0;
+}
+
+static void oxp_mock_fan_update(void)
+{
+	u64 now = ktime_get_ns();
+	s64 dt = div_u64(now - oxp_mock_fan_ns, NSEC_PER_MSEC);
+	int rpm = (oxp_mock_ram[OXP_SENSOR_FAN_REG] << 8) |
+		  oxp_mock_ram[OXP_SENSOR_FAN_REG + 1];
+	int target = oxp_mock_ram[OXP_SENSOR_PWM_REG] * OXP_MOCK_FAN_MAX_RPM /
+		     board_info->pwm_max;
+
+	rpm += div64_s64((s64)(target - rpm) * dt, OXP_MOCK_FAN_TAU_MS + dt);
+	oxp_mock_ram[OXP_SENSOR_FAN_REG] = rpm >> 8;
+	oxp_mock_ram[OXP_SENSOR_FAN_REG + 1] = rpm & 0xff;
+	oxp_mock_fan_ns = now;
+}
+
+static int oxp_mock_read(u8 reg, u8 *val)
+{
+	int ret = oxp_mock_transaction();
+
+	if (ret)
+		return ret;
+
+	if (reg == OXP_SENSOR_FAN_REG)
+		oxp_mock_fan_update();
+	*val = READ_ONCE(oxp_mock_ram[reg]);
+
+	return 0;
+}
+
+static int oxp_mock_write(u8 reg, u8 val)
+{
+	int ret = oxp_mock_transaction();
+
+	if (ret)
+		return ret;
+
+	WRITE_ONCE(oxp_mock_ram[reg], val);
+
+	return 0;
+}
+
+enum oxp_transport_id {
+	OXP_TRANSPORT_ACPI,
+	OXP_TRANSPORT_IOPORT,
+	OXP_TRANSPORT_MOCK,
+};
+
+static const struct oxp_ec_transport oxp_transports[] = {
+	[OXP_TRANSPORT_ACPI] = {
+		.name = "acpi",
+		.read = oxp_acpi_read,
+		.write = oxp_acpi_write,
 	},
-	{
-		.matches = {
-			DMI_MATCH(DMI_BOARD_VENDOR, "ONE-NETBOOK"),
-			DMI_EXACT_MATCH(DMI_BOARD_NAME, "ONEXPLAYER mini A07"),
-		},
-		.driver_data = (void *)oxp_mini_amd_a07,
+	[OXP_TRANSPORT_IOPORT] = {
+		.name = "ioport",
+		.read = oxp_ioport_read,
+		.write = oxp_ioport_write,
+		.atomic = true,
 	},
-	{
-		.matches = {
-			DMI_MATCH(DMI_BOARD_VENDOR, "ONE-NETBOOK"),
-			DMI_EXACT_MATCH(DMI_BOARD_NAME, "ONEXPLAYER Mini Pro"),
-		},
-		.driver_data = (void *)oxp_mini_amd_pro,
+	[OXP_TRANSPORT_MOCK] = {
+		.name = "mock",
+		.read = oxp_mock_read,
+		.write = oxp_mock_write,
+		.atomic = true,
 	},
-	{},
 };
 
+static const struct oxp_ec_transport *oxp_ec;
+
+static int oxp_transport_init(struct device *dev)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(oxp_transports); i++) {
+		if (sysfs_streq(ec_transport, oxp_transports[i].name))
+			break;
+	}
+	if (i == ARRAY_SIZE(oxp_transports)) {
+		dev_err(dev, "unknown EC transport %s\n", ec_transport);
+		return -EINVAL;
+	}
+
+	if (i == OXP_TRANSPORT_IOPORT) {
+		if (!ec_index_port || !ec_data_port) {
+			dev_err(dev, "ioport transport needs ec_index_port and ec_data_port\n");
+			return -EINVAL;
+		}
+		if (!devm_request_region(dev, ec_index_port, 1, "oxp-sensors") ||
+		    !devm_request_region(dev, ec_data_port, 1, "oxp-sensors"))
+			return -EBUSY;
+	}
+
+	oxp_ec = &oxp_transports[i];
+
+	return 0;
+}
+
 /* Helper functions to handle EC read/write */
+static enum oxp_ec_path oxp_ec_path(u8 reg)
+{
+	switch (reg) {
+	case OXP_SENSOR_FAN_REG:
+		return OXP_PATH_FAN;
+	case OXP_SENSOR_PWM_ENABLE_REG:
+		return OXP_PATH_PWM_ENABLE;
+	case OXP_SENSOR_PWM_REG:
+		return OXP_PATH_PWM;
+	default:
+		if (board_info && board_info->turbo_reg &&
+		    reg == board_info->turbo_reg)
+			return OXP_PATH_TURBO;
+		return OXP_PATH_OTHER;
+	}
+}
+
 static int read_from_ec(u8 reg, int size, long *val)
 {
+	u64 start = ktime_get_ns();
 	int i;
 	int ret;
 	u8 buffer;
@@ -148,9 +497,14 @@ static int read_from_ec(u8 reg, int size, long *val)
 
 	*val = 0;
 	for (i = 0; i < size; i++) {
-		ret = ec_read(reg + i, &buffer);
-		if (ret)
+		ret = oxp_ec->read(reg + i, &buffer);
+		atomic64_inc(&oxp_stats.reads);
+		if (ret) {
+			atomic64_inc(&oxp_stats.errors);
+			unlock_global_acpi_lock();
 			return ret;
+		}
+		oxp_cache_update(reg + i, buffer);
 		*val <<= i * 8;
 		*val += buffer;
 	}
@@ -158,325 +512,3048 @@ static int read_from_ec(u8 reg, int size, long *val)
 	if (!unlock_global_acpi_lock())
 		return -EBUSY;
 
+	oxp_latency_add(&oxp_stats.read_lat[oxp_ec_path(reg)],
+			ktime_get_ns() - start);
+
 	return 0;
 }
 
 static int write_to_ec(u8 reg, u8 value)
 {
+	u64 start = ktime_get_ns();
 	int ret;
 
 	if (!lock_global_acpi_lock())
 		return -EBUSY;
 
-	ret = ec_write(reg, value);
+	ret = oxp_ec->write(reg, value);
+	atomic64_inc(&oxp_stats.writes);
+	if (ret)
+		atomic64_inc(&oxp_stats.errors);
 
 	if (!unlock_global_acpi_lock())
 		return -EBUSY;
 
+	if (!ret) {
+		oxp_cache_update(reg, value);
+		oxp_latency_add(&oxp_stats.write_lat[oxp_ec_path(reg)],
+				ktime_get_ns() - start);
+	}
+
 	return ret;
 }
 
-/* Turbo button toggle functions */
-static int tt_toggle_enable(void)
+/* Reads several registers in a single hold of the global lock */
+static int read_from_ec_batch(const u8 *regs, u8 *vals, int count)
 {
-	u8 reg;
-	u8 val;
+	u64 start = ktime_get_ns();
+	int ret = 0;
+	int i;
 
-	switch (board) {
-	case oxp_mini_amd_a07:
-		reg = OXP_OLD_TURBO_SWITCH_REG;
-		val = OXP_OLD_TURBO_TAKE_VAL;
-		break;
-	case oxp_mini_amd_pro:
-	case aok_zoe_a1:
-		reg = OXP_TURBO_SWITCH_REG;
-		val = OXP_TURBO_TAKE_VAL;
-		break;
-	default:
-		return -EINVAL;
+	if (!lock_global_acpi_lock())
+		return -EBUSY;
+
+	for (i = 0; i < count; i++) {
+		ret = oxp_ec->read(regs[i], &vals[i]);
+		atomic64_inc(&oxp_stats.reads);
+		if (ret) {
+			atomic64_inc(&oxp_stats.errors);
+			break;
+		}
+		oxp_cache_update(regs[i], vals[i]);
 	}
-	return write_to_ec(reg, val);
+
+	if (!unlock_global_acpi_lock())
+		return -EBUSY;
+
+	if (!ret)
+		oxp_latency_add(&oxp_stats.batch_lat, ktime_get_ns() - start);
+
+	return ret;
 }
 
-static int tt_toggle_disable(void)
+/*
+ * EC refresh cadence
+ * The EC refreshes its fan registers at its own internal rate. With
+ * sample_phase_lock set the sampler measures that rate by watching the fan
+ * speed change at a fast probe rate for a short while, then schedules its
+ * ticks just after each expected refresh and uses the refresh period as the
+ * cache lifetime. Detection is repeated from time to time to follow drift.
+ * The fast probes only feed the detection: fan policies and the history
+ * keep running on the sample_interval_ms schedule, which they assume.
+ */
+#define OXP_CADENCE_PROBE_MS		20
+#define OXP_CADENCE_PROBES		100
+#define OXP_CADENCE_MIN_CHANGES		4
+#define OXP_CADENCE_REDETECT_TICKS	3600
+
+static int oxp_sampler_param_set_bool(const char *val,
+				      const struct kernel_param *kp);
+
+static const struct kernel_param_ops oxp_sampler_bool_ops = {
+	.set = oxp_sampler_param_set_bool,
+	.get = param_get_bool,
+};
+
+static bool sample_phase_lock;
+module_param_cb(sample_phase_lock, &oxp_sampler_bool_ops, &sample_phase_lock, 0644);
+MODULE_PARM_DESC(sample_phase_lock, "Detect the EC refresh period and sample in phase with it");
+
+static struct {
+	unsigned int probes;	/* samples left in the detection phase */
+	unsigned int changes;
+	unsigned int ticks;	/* since the last detection */
+	u16 last_rpm;
+	u64 last_change_ns;
+	u64 min_interval_ns;
+	u64 period_ns;		/* 0 while unknown */
+	u64 phase_ns;		/* time of an observed refresh */
+} oxp_cadence;
+
+static unsigned long oxp_cache_max_age(void)
 {
-	u8 reg;
-	u8 val;
+	u64 period = READ_ONCE(oxp_cadence.period_ns);
 
-	switch (board) {
-	case oxp_mini_amd_a07:
-		reg = OXP_OLD_TURBO_SWITCH_REG;
-		val = OXP_OLD_TURBO_RETURN_VAL;
-		break;
-	case oxp_mini_amd_pro:
-	case aok_zoe_a1:
-		reg = OXP_TURBO_SWITCH_REG;
-		val = OXP_TURBO_RETURN_VAL;
-		break;
-	default:
-		return -EINVAL;
-	}
-	return write_to_ec(reg, val);
+	if (READ_ONCE(sample_phase_lock) && period)
+		return nsecs_to_jiffies(period);
+
+	return msecs_to_jiffies(READ_ONCE(cache_ms));
 }
 
-/* Callbacks for turbo toggle attribute */
-static ssize_t tt_toggle_store(struct device *dev,
-			       struct device_attribute *attr, const char *buf,
-			       size_t count)
+/*
+ * Register demand
+ * Each interface read stamps the register group it touched. The sampler
+ * only includes groups read within the last OXP_DEMAND_MS in its batch, on
+ * top of what the active policies need, so nobody pays for registers no one
+ * looks at. The first read after a group went idle always goes to the EC,
+ * as the sampler has stopped refreshing its cached value. Without a cache
+ * lifetime no reader would use what the sampler refreshes, so demand is
+ * then ignored.
+ */
+#define OXP_DEMAND_MS	10000
+
+static unsigned long oxp_demand[OXP_IFACE_MAX][OXP_PATH_MAX];
+
+static bool oxp_demand_active(unsigned long stamp)
 {
-	int rval;
-	bool value;
+	return stamp && time_before(jiffies, stamp + msecs_to_jiffies(OXP_DEMAND_MS));
+}
 
-	rval = kstrtobool(buf, &value);
-	if (rval)
-		return rval;
+/* Returns whether the group of reg was already in demand */
+static bool oxp_demand_note(enum oxp_iface iface, u8 reg)
+{
+	unsigned long *stamp = &oxp_demand[iface][oxp_ec_path(reg)];
+	bool active = oxp_demand_active(READ_ONCE(*stamp));
 
-	if (value) {
-		rval = tt_toggle_enable();
-	} else {
-		rval = tt_toggle_disable();
-	}
-	if (rval)
-		return rval;
+	WRITE_ONCE(*stamp, jiffies ?: 1);
 
-	return count;
+	return active;
 }
 
-static ssize_t tt_toggle_show(struct device *dev,
-			      struct device_attribute *attr, char *buf)
+static bool oxp_demanded(enum oxp_ec_path path)
 {
-	int retval;
-	u8 reg;
-	long val;
+	int i;
 
-	switch (board) {
-	case oxp_mini_amd_a07:
-		reg = OXP_OLD_TURBO_SWITCH_REG;
-		break;
-	case oxp_mini_amd_pro:
-	case aok_zoe_a1:
-		reg = OXP_TURBO_SWITCH_REG;
-		break;
-	default:
-		return -EINVAL;
-	}
+	if (!oxp_cache_max_age())
+		return false;
 
-	retval = read_from_ec(reg, 1, &val);
-	if (retval)
-		return retval;
+	for (i = 0; i < OXP_IFACE_MAX; i++) {
+		if (oxp_demand_active(READ_ONCE(oxp_demand[i][path])))
+			return true;
+	}
 
-	return sysfs_emit(buf, "%d\n", !!val);
+	return false;
 }
 
-static DEVICE_ATTR_RW(tt_toggle);
+/*
+ * Read-ahead
+ * A cache miss already pays for taking the global lock, and one more byte in
+ * the same hold costs little next to that. On a miss, the register groups in
+ * the readahead mask are read in the same batch so that the reads usually
+ * following (pwm1 after fan1_input...) hit the cache.
+ */
+static unsigned int readahead = BIT(OXP_PATH_FAN) | BIT(OXP_PATH_PWM_ENABLE) |
+				BIT(OXP_PATH_PWM);
+module_param(readahead, uint, 0644);
+MODULE_PARM_DESC(readahead, "Register groups read along a cache miss (bit 0 fan, 1 pwm_enable, 2 pwm, 3 turbo)");
 
-/* PWM enable/disable functions */
-static int oxp_pwm_enable(void)
-{
-	return write_to_ec(OXP_SENSOR_PWM_ENABLE_REG, 0x01);
-}
+#define OXP_READAHEAD_MAX	8
 
-static int oxp_pwm_disable(void)
+static int oxp_readahead_regs(u8 *regs, enum oxp_ec_path skip)
 {
-	return write_to_ec(OXP_SENSOR_PWM_ENABLE_REG, 0x00);
-}
+	unsigned int mask = READ_ONCE(readahead) & ~BIT(skip);
+	int n = 0;
 
-/* Callbacks for hwmon interface */
-static umode_t oxp_ec_hwmon_is_visible(const void *drvdata,
-				       enum hwmon_sensor_types type, u32 attr, int channel)
-{
-	switch (type) {
-	case hwmon_fan:
-		return 0444;
-	case hwmon_pwm:
-		return 0644;
-	default:
-		return 0;
+	if (mask & BIT(OXP_PATH_FAN)) {
+		regs[n++] = OXP_SENSOR_FAN_REG;
+		regs[n++] = OXP_SENSOR_FAN_REG + 1;
 	}
+	if (mask & BIT(OXP_PATH_PWM_ENABLE))
+		regs[n++] = OXP_SENSOR_PWM_ENABLE_REG;
+	if (mask & BIT(OXP_PATH_PWM))
+		regs[n++] = OXP_SENSOR_PWM_REG;
+	if ((mask & BIT(OXP_PATH_TURBO)) && board_info->turbo_reg)
+		regs[n++] = board_info->turbo_reg;
+
+	return n;
 }
 
-static int oxp_platform_read(struct device *dev, enum hwmon_sensor_types type,
-			     u32 attr, int channel, long *val)
+static void oxp_sampler_coalesce(void);
+
+/* EC read for a reader, along with the read-ahead groups if ahead is set */
+static int read_from_ec_reader(enum oxp_iface iface, u8 reg, int size,
+			       bool ahead, long *val)
+{
+	u8 regs[OXP_READAHEAD_MAX], vals[OXP_READAHEAD_MAX];
+	int i, n = size;
+	int ret;
+
+	for (i = 0; i < size; i++)
+		regs[i] = reg + i;
+	if (ahead)
+		n += oxp_readahead_regs(&regs[size], oxp_ec_path(reg));
+
+	if (n == size) {
+		ret = read_from_ec(reg, size, val);
+	} else {
+		ret = read_from_ec_batch(regs, vals, n);
+		*val = 0;
+		for (i = 0; i < size; i++)
+			*val = (*val << 8) | vals[i];
+	}
+	atomic64_add(n, &oxp_stats.iface_ec_reads[iface]);
+	oxp_sampler_coalesce();
+
+	return ret;
+}
+
+static int read_from_ec_cached(enum oxp_iface iface, u8 reg, int size,
+			       long *val)
+{
+	unsigned long max_age = oxp_cache_max_age();
+
+	if (!oxp_demand_note(iface, reg) || !max_age)
+		return read_from_ec_reader(iface, reg, size, false, val);
+
+	if (oxp_cache_lookup(reg, size, max_age, val)) {
+		atomic64_inc(&oxp_stats.cache_hits);
+		return 0;
+	}
+	atomic64_inc(&oxp_stats.cache_misses);
+
+	return read_from_ec_reader(iface, reg, size, true, val);
+}
+
+/* Batched counterpart of read_from_ec_cached() */
+static int read_from_ec_batch_cached(enum oxp_iface iface, const u8 *regs,
+				     u8 *vals, int count)
+{
+	unsigned long max_age = oxp_cache_max_age();
+	bool demanded = true;
+	long val;
+	int i, ret;
+
+	for (i = 0; i < count; i++)
+		demanded &= oxp_demand_note(iface, regs[i]);
+
+	if (demanded && max_age) {
+		for (i = 0; i < count; i++) {
+			if (!oxp_cache_lookup(regs[i], 1, max_age, &val))
+				break;
+			vals[i] = val;
+		}
+		if (i == count) {
+			atomic64_inc(&oxp_stats.cache_hits);
+			return 0;
+		}
+		atomic64_inc(&oxp_stats.cache_misses);
+	}
+
+	ret = read_from_ec_batch(regs, vals, count);
+	atomic64_add(count, &oxp_stats.iface_ec_reads[iface]);
+	oxp_sampler_coalesce();
+
+	return ret;
+}
+
+/*
+ * Change-suppressed write: skips the EC transaction when the register was
+ * seen holding the same value within the last sampling interval.
+ */
+#define OXP_SAMPLE_MIN_MS	10
+
+static unsigned int sample_interval_ms = 1000;
+module_param(sample_interval_ms, uint, 0644);
+MODULE_PARM_DESC(sample_interval_ms, "Background sampling period while a fan policy is active (ms)");
+
+static unsigned long oxp_sample_interval(void)
+{
+	return msecs_to_jiffies(max(READ_ONCE(sample_interval_ms), OXP_SAMPLE_MIN_MS));
+}
+
+static int write_to_ec_changed(u8 reg, u8 value)
+{
+	long cur;
+
+	if (oxp_cache_lookup(reg, 1, oxp_sample_interval(), &cur) && cur == value) {
+		atomic64_inc(&oxp_stats.writes_suppressed);
+		return 0;
+	}
+
+	return write_to_ec(reg, value);
+}
+
+/*
+ * Audit log of control writes
+ * Every write to a control attribute is recorded with the writing task, the
+ * attribute's value before (-1 if never seen) and the value written, both in
+ * the attribute's units, the raw byte sent to the EC (-1 if none) and the
+ * time spent in the EC. Writers claim a slot with a single atomic increment
+ * and publish it by storing its sequence number last; readers skip slots
+ * that were overwritten while being copied.
+ */
+#define OXP_AUDIT_SIZE	256
+
+enum oxp_audit_attr {
+	OXP_AUDIT_PWM_ENABLE,
+	OXP_AUDIT_PWM,
+	OXP_AUDIT_TT_TOGGLE,
+};
+
+static const char * const oxp_audit_attr_names[] = {
+	[OXP_AUDIT_PWM_ENABLE] = "pwm1_enable",
+	[OXP_AUDIT_PWM] = "pwm1",
+	[OXP_AUDIT_TT_TOGGLE] = "tt_toggle",
+};
+
+struct oxp_audit_entry {
+	u64 seq;
+	u64 timestamp_ns;
+	u64 latency_ns;
+	long old_val;
+	long new_val;
+	long ec_val;
+	pid_t pid;
+	int ret;
+	enum oxp_audit_attr attr;
+	char comm[TASK_COMM_LEN];
+};
+
+static struct {
+	atomic64_t head;
+	struct oxp_audit_entry ring[OXP_AUDIT_SIZE];
+} oxp_audit;
+
+static void oxp_audit_record(enum oxp_audit_attr attr, long old_val,
+			     long new_val, long ec_val, u64 latency_ns, int ret)
+{
+	u64 seq = atomic64_inc_return(&oxp_audit.head);
+	struct oxp_audit_entry *e = &oxp_audit.ring[seq % OXP_AUDIT_SIZE];
+
+	WRITE_ONCE(e->seq, 0);
+	smp_wmb();
+	e->timestamp_ns = ktime_get_ns();
+	e->latency_ns = latency_ns;
+	e->old_val = old_val;
+	e->new_val = new_val;
+	e->ec_val = ec_val;
+	e->pid = task_tgid_nr(current);
+	e->ret = ret;
+	e->attr = attr;
+	get_task_comm(e->comm, current);
+	smp_store_release(&e->seq, seq);
+}
+
+/* Turbo button toggle functions */
+static int tt_toggle_reg(u8 *reg)
+{
+	if (!board_info->turbo_reg)
+		return -EINVAL;
+
+	*reg = board_info->turbo_reg;
+	return 0;
+}
+
+static int tt_toggle_enable(void)
+{
+	if (!board_info->turbo_reg)
+		return -EINVAL;
+
+	return write_to_ec(board_info->turbo_reg, board_info->turbo_take_val);
+}
+
+static int tt_toggle_disable(void)
+{
+	if (!board_info->turbo_reg)
+		return -EINVAL;
+
+	return write_to_ec(board_info->turbo_reg, board_info->turbo_return_val);
+}
+
+/* Callbacks for turbo toggle attribute */
+static ssize_t tt_toggle_store(struct device *dev,
+			       struct device_attribute *attr, const char *buf,
+			       size_t count)
+{
+	long old_val = -1, ec_val = -1;
+	u64 start;
+	int rval;
+	bool value;
+	u8 reg;
+
+	rval = kstrtobool(buf, &value);
+	if (rval)
+		return rval;
+
+	if (!tt_toggle_reg(&reg)) {
+		if (oxp_cache_peek(reg, &old_val))
+			old_val = !!old_val;
+		ec_val = value ? board_info->turbo_take_val :
+				 board_info->turbo_return_val;
+	}
+
+	start = ktime_get_ns();
+	if (value) {
+		rval = tt_toggle_enable();
+	} else {
+		rval = tt_toggle_disable();
+	}
+	oxp_audit_record(OXP_AUDIT_TT_TOGGLE, old_val, value, ec_val,
+			 ktime_get_ns() - start, rval);
+	if (rval)
+		return rval;
+
+	return count;
+}
+
+static ssize_t tt_toggle_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	u64 start = ktime_get_ns();
+	int retval;
+	u8 reg;
+	long val;
+
+	retval = tt_toggle_reg(&reg);
+	if (retval)
+		return retval;
+
+	retval = read_from_ec_cached(OXP_IFACE_ATTR, reg, 1, &val);
+	if (retval)
+		return retval;
+
+	oxp_iface_account(OXP_IFACE_ATTR, start);
+
+	return sysfs_emit(buf, "%d\n", !!val);
+}
+
+static DEVICE_ATTR_RW(tt_toggle);
+
+/* PWM enable/disable functions */
+static int oxp_pwm_enable(void)
+{
+	return write_to_ec(OXP_SENSOR_PWM_ENABLE_REG, 0x01);
+}
+
+static int oxp_pwm_disable(void)
+{
+	return write_to_ec(OXP_SENSOR_PWM_ENABLE_REG, 0x00);
+}
+
+/* Maximum PWM value in EC units */
+static int oxp_pwm_max_raw(void)
+{
+	return board_info->pwm_max;
+}
+
+/*
+ * Fan control state, protected by oxp_ctl_lock.
+ * pwm_request is the last duty written through pwm1 in EC units, or -1 if
+ * unknown. The RPM limiter keeps a PWM ceiling that is lowered one step per
+ * sample while the fan spins above fan1_max_target and raised again once it
+ * is back under the target minus hysteresis. In automatic mode the driver
+ * takes manual control while the ceiling is active. Every
+ * OXP_LIMIT_RELEASE_TICKS it probes the EC's own duty by handing control
+ * back for OXP_LIMIT_PROBE_MS, far too short for the fan to speed up, and
+ * only leaves it to the EC if that duty is below the ceiling.
+ */
+#define OXP_RPM_HYSTERESIS		200
+#define OXP_LIMIT_RELEASE_TICKS		30
+#define OXP_LIMIT_PROBE_MS		100
+
+static struct {
+	int pwm_request;
+	unsigned int max_rpm;
+	int ceiling;
+	bool took_over;
+	bool probing;		/* EC given its duty back for one tick */
+	unsigned int held_ticks;
+} oxp_ctl;
+static DEFINE_MUTEX(oxp_ctl_lock);
+
+/* Set on reboot and panic, policies must not write to the EC any more */
+static bool oxp_shutting_down;
+
+/*
+ * Load feedforward
+ * CPU load is measured from idle time at every sample. As soon as a sample
+ * sees it at least ff_load_step percent above its slow moving average, the
+ * manual duty is bumped by ff_boost; the bump then decays with a ff_decay_ms
+ * time constant back to the requested duty.
+ */
+static int oxp_sampler_param_set_uint(const char *val,
+				      const struct kernel_param *kp);
+
+static const struct kernel_param_ops oxp_sampler_uint_ops = {
+	.set = oxp_sampler_param_set_uint,
+	.get = param_get_uint,
+};
+
+static unsigned int ff_boost;
+module_param_cb(ff_boost, &oxp_sampler_uint_ops, &ff_boost, 0644);
+MODULE_PARM_DESC(ff_boost, "PWM boost [0-255] applied in manual mode on CPU load steps (0 to disable)");
+
+static unsigned int ff_load_step = 30;
+module_param(ff_load_step, uint, 0644);
+MODULE_PARM_DESC(ff_load_step, "CPU load increase in percent that triggers the boost");
+
+static unsigned int ff_decay_ms = 5000;
+module_param(ff_decay_ms, uint, 0644);
+MODULE_PARM_DESC(ff_decay_ms, "Time constant of the boost decay (ms)");
+
+static struct {
+	u64 idle_us;
+	u64 wall_us;
+	int load_avg;
+	int boost;
+} oxp_ff;
+
+/* Returns the CPU load in percent since the last call, or -1 */
+static int oxp_ff_load(void)
+{
+	u64 idle = 0, wall = 0, cpu_wall, d_idle, d_wall;
+	bool first;
+	int cpu;
+
+	if (!IS_ENABLED(CONFIG_CPU_FREQ))
+		return -1;
+
+	for_each_online_cpu(cpu) {
+		idle += get_cpu_idle_time(cpu, &cpu_wall, 0);
+		wall += cpu_wall;
+	}
+
+	d_idle = idle - oxp_ff.idle_us;
+	d_wall = wall - oxp_ff.wall_us;
+	first = !oxp_ff.wall_us;
+	oxp_ff.idle_us = idle;
+	oxp_ff.wall_us = wall;
+
+	/* CPU hotplug makes the sums jump, skip that sample */
+	if (first || !d_wall || d_idle > d_wall)
+		return -1;
+
+	return 100 - div64_u64(d_idle * 100, d_wall);
+}
+
+static void oxp_ff_update(void)
+{
+	unsigned int boost = READ_ONCE(ff_boost);
+	unsigned int decay_ms = max(READ_ONCE(ff_decay_ms), 1U);
+	int load = oxp_ff_load();
+	bool step;
+	int decay;
+
+	if (load < 0 || !boost) {
+		oxp_ff.boost = 0;
+		return;
+	}
+
+	step = load >= oxp_ff.load_avg + (int)READ_ONCE(ff_load_step);
+	oxp_ff.load_avg += (load - oxp_ff.load_avg) / 8;
+
+	if (step) {
+		oxp_ff.boost = min(boost, 255U) * oxp_pwm_max_raw() / 255;
+	} else if (oxp_ff.boost) {
+		decay = oxp_ff.boost * jiffies_to_msecs(oxp_sample_interval()) / decay_ms;
+		oxp_ff.boost -= clamp(decay, 1, oxp_ff.boost);
+	}
+}
+
+/*
+ * Thermal budget policy
+ * With a setpoint set, the fused temperature above it is integrated over
+ * time against a budget in millidegree seconds, and paid back below it. In
+ * manual mode the duty stays at pwm_min until OXP_BUDGET_KNEE_PCT of the
+ * budget is used and then rises proportionally to pwm_max as the rest runs
+ * out, so short load spikes cost no fan noise and no EC writes while
+ * sustained heat still ramps the fan.
+ * Without a valid temperature the duty goes to pwm_max. Protected by
+ * oxp_ctl_lock.
+ */
+#define OXP_BUDGET_KNEE_PCT	75
+#define OXP_BUDGET_DEF_SIZE	300000
+#define OXP_BUDGET_DEF_PWM_MIN	64
+#define OXP_BUDGET_DEF_PWM_MAX	255
+
+enum oxp_budget_attr {
+	OXP_BUDGET_SETPOINT,
+	OXP_BUDGET_SIZE,
+	OXP_BUDGET_PWM_MIN,
+	OXP_BUDGET_PWM_MAX,
+	OXP_BUDGET_USED,
+};
+
+static struct {
+	long setpoint;		/* millidegrees, 0 when disabled */
+	long size;		/* millidegree seconds */
+	long pwm_min;		/* 0-255 like pwm1 */
+	long pwm_max;
+	s64 used;		/* millidegree milliseconds */
+	bool temp_valid;
+	u64 last_ns;
+} oxp_budget;
+
+static void oxp_budget_update(long temp, bool valid, u64 now)
+{
+	s64 dt = 0;
+
+	lockdep_assert_held(&oxp_ctl_lock);
+
+	if (oxp_budget.last_ns)
+		dt = div_u64(now - oxp_budget.last_ns, NSEC_PER_MSEC);
+	oxp_budget.last_ns = now;
+	oxp_budget.temp_valid = valid;
+	if (!oxp_budget.setpoint || !valid)
+		return;
+
+	oxp_budget.used = clamp_val(oxp_budget.used +
+				    (temp - oxp_budget.setpoint) * dt, 0,
+				    (s64)oxp_budget.size * MSEC_PER_SEC);
+}
+
+/* Duty wanted by the budget policy, or -1 when it is disabled */
+static int oxp_budget_pwm(void)
+{
+	s64 full = (s64)oxp_budget.size * MSEC_PER_SEC;
+	s64 knee = div_s64(full * OXP_BUDGET_KNEE_PCT, 100);
+	long pwm = oxp_budget.pwm_max;
+
+	lockdep_assert_held(&oxp_ctl_lock);
+
+	if (!oxp_budget.setpoint)
+		return -1;
+
+	if (oxp_budget.temp_valid && oxp_budget.used <= knee)
+		pwm = oxp_budget.pwm_min;
+	else if (oxp_budget.temp_valid)
+		pwm = oxp_budget.pwm_min +
+		      div64_s64((oxp_budget.pwm_max - oxp_budget.pwm_min) *
+				(oxp_budget.used - knee), full - knee);
+
+	return pwm * oxp_pwm_max_raw() / 255;
+}
+
+static void oxp_sampler_ensure(void);
+
+/* Duty wanted in manual mode before the RPM ceiling, or -1 if unknown */
+static int oxp_ctl_demand(void)
+{
+	int base = oxp_budget.setpoint ? oxp_budget_pwm() : oxp_ctl.pwm_request;
+
+	if (base < 0)
+		return -1;
+
+	return min(base + oxp_ff.boost, oxp_pwm_max_raw());
+}
+
+static int oxp_ctl_set_enable(bool enable)
+{
+	long old_val;
+	u64 start;
+	int ret;
+
+	mutex_lock(&oxp_ctl_lock);
+	oxp_cache_peek(OXP_SENSOR_PWM_ENABLE_REG, &old_val);
+	oxp_ctl.took_over = false;
+	if (!enable)
+		oxp_ctl.pwm_request = -1;
+	start = ktime_get_ns();
+	ret = enable ? oxp_pwm_enable() : oxp_pwm_disable();
+	oxp_audit_record(OXP_AUDIT_PWM_ENABLE, old_val, enable, enable,
+			 ktime_get_ns() - start, ret);
+	mutex_unlock(&oxp_ctl_lock);
+
+	return ret;
+}
+
+/* Takes the pwm1 value [0-255]; the audit log keeps it next to the EC byte */
+static int oxp_ctl_set_pwm(long val)
+{
+	long old_val = -1;
+	u64 start;
+	long raw;
+	int ret;
+
+	mutex_lock(&oxp_ctl_lock);
+	if (oxp_cache_peek(OXP_SENSOR_PWM_REG, &old_val))
+		old_val = old_val * 255 / oxp_pwm_max_raw();
+	oxp_ctl.pwm_request = val * oxp_pwm_max_raw() / 255;
+	raw = min(oxp_ctl_demand(), oxp_ctl.ceiling);
+	start = ktime_get_ns();
+	ret = write_to_ec(OXP_SENSOR_PWM_REG, raw);
+	oxp_audit_record(OXP_AUDIT_PWM, old_val, val, raw,
+			 ktime_get_ns() - start, ret);
+	oxp_sampler_ensure();
+	mutex_unlock(&oxp_ctl_lock);
+
+	return ret;
+}
+
+static void oxp_limit_release(void)
+{
+	oxp_ctl.ceiling = INT_MAX;
+	oxp_ctl.held_ticks = 0;
+	oxp_ctl.probing = false;
+	if (oxp_ctl.took_over) {
+		oxp_ctl.took_over = false;
+		oxp_pwm_disable();
+	}
+}
+
+static void oxp_ctl_update(long rpm, bool enabled, int pwm)
+{
+	int pwm_max = oxp_pwm_max_raw();
+	int step = max(pwm_max / 32, 1);
+	int demand, target;
+	bool manual;
+
+	lockdep_assert_held(&oxp_ctl_lock);
+
+	if (READ_ONCE(oxp_shutting_down))
+		return;
+
+	oxp_ff_update();
+	demand = oxp_ctl_demand();
+	manual = enabled && !oxp_ctl.took_over;
+
+	/* The PWM register now holds the EC's own duty */
+	if (oxp_ctl.probing && !enabled) {
+		oxp_ctl.probing = false;
+		if (!oxp_ctl.max_rpm || pwm < oxp_ctl.ceiling) {
+			oxp_limit_release();
+		} else if (!oxp_pwm_enable()) {
+			oxp_ctl.took_over = true;
+			write_to_ec_changed(OXP_SENSOR_PWM_REG, oxp_ctl.ceiling);
+		}
+		return;
+	}
+	oxp_ctl.probing = false;
+
+	if (oxp_ctl.max_rpm && rpm > oxp_ctl.max_rpm) {
+		oxp_ctl.ceiling = max(min(oxp_ctl.ceiling, pwm) - step, 0);
+	} else if (rpm + OXP_RPM_HYSTERESIS < oxp_ctl.max_rpm &&
+		   oxp_ctl.ceiling < pwm_max) {
+		oxp_ctl.ceiling += step;
+	}
+
+	if (!oxp_ctl.max_rpm || oxp_ctl.ceiling >= pwm_max) {
+		oxp_limit_release();
+		if (manual && demand >= 0)
+			write_to_ec_changed(OXP_SENSOR_PWM_REG, demand);
+		return;
+	}
+
+	if (oxp_ctl.took_over && ++oxp_ctl.held_ticks >= OXP_LIMIT_RELEASE_TICKS) {
+		oxp_ctl.held_ticks = 0;
+		if (!oxp_pwm_disable()) {
+			oxp_ctl.took_over = false;
+			oxp_ctl.probing = true;
+		}
+		return;
+	}
+
+	if (!enabled) {
+		if (oxp_pwm_enable())
+			return;
+		oxp_ctl.took_over = true;
+	}
+
+	target = oxp_ctl.ceiling;
+	if (!oxp_ctl.took_over && demand >= 0)
+		target = min(target, demand);
+	write_to_ec_changed(OXP_SENSOR_PWM_REG, target);
+}
+
+/*
+ * Restore EC fan control on reboot and panic
+ * A fan left in manual mode at a low duty stays that way through firmware
+ * POST until the EC resets, so automatic control and the turbo button are
+ * handed back to the EC on the way down. Only registers this driver has
+ * seen in a non default state are written. On reboot the path waits for a
+ * running tick and for the global lock, both within OXP_RESTORE_WAIT_MS in
+ * total; from panic context it never waits and only runs on transports that
+ * do not sleep.
+ */
+#define OXP_RESTORE_WAIT_MS	200
+
+static void oxp_restore_reg(u8 reg, u8 val)
+{
+	long cur;
+
+	if (oxp_cache_peek(reg, &cur) && cur != val)
+		oxp_ec->write(reg, val);
+}
+
+static void oxp_restore_ec(bool atomic, u16 wait_ms)
+{
+	if (!oxp_ec || !board_info || (atomic && !oxp_ec->atomic))
+		return;
+
+	if (!ACPI_SUCCESS(acpi_acquire_global_lock(wait_ms, &oxp_mutex)))
+		return;
+
+	oxp_restore_reg(OXP_SENSOR_PWM_ENABLE_REG, 0x00);
+	if (board_info->turbo_reg)
+		oxp_restore_reg(board_info->turbo_reg,
+				board_info->turbo_return_val);
+
+	acpi_release_global_lock(oxp_mutex);
+}
+
+static int oxp_reboot_notify(struct notifier_block *nb, unsigned long action,
+			     void *data)
+{
+	u64 deadline = ktime_get_ns() + OXP_RESTORE_WAIT_MS * NSEC_PER_MSEC;
+	bool locked;
+	u64 now;
+
+	/* Keep the sampler from taking control back */
+	WRITE_ONCE(oxp_shutting_down, true);
+	for (;;) {
+		locked = mutex_trylock(&oxp_ctl_lock);
+		now = ktime_get_ns();
+		if (locked || now >= deadline)
+			break;
+		usleep_range(500, 1000);
+	}
+	oxp_restore_ec(false, now < deadline ?
+			      div_u64(deadline - now, NSEC_PER_MSEC) : 0);
+	if (locked)
+		mutex_unlock(&oxp_ctl_lock);
+
+	return NOTIFY_DONE;
+}
+
+static int oxp_panic_notify(struct notifier_block *nb, unsigned long action,
+			    void *data)
+{
+	WRITE_ONCE(oxp_shutting_down, true);
+	oxp_restore_ec(true, 0);
+
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block oxp_reboot_nb = {
+	.notifier_call = oxp_reboot_notify,
+};
+
+static struct notifier_block oxp_panic_nb = {
+	.notifier_call = oxp_panic_notify,
+};
+
+static void oxp_restore_remove(void *data)
+{
+	atomic_notifier_chain_unregister(&panic_notifier_list, &oxp_panic_nb);
+	unregister_reboot_notifier(&oxp_reboot_nb);
+}
+
+static int oxp_restore_init(struct device *dev)
+{
+	int ret;
+
+	ret = register_reboot_notifier(&oxp_reboot_nb);
+	if (ret)
+		return ret;
+	atomic_notifier_chain_register(&panic_notifier_list, &oxp_panic_nb);
+
+	return devm_add_action_or_reset(dev, oxp_restore_remove, NULL);
+}
+
+/*
+ * Fan history
+ * With history_kb set, every sample of fan speed and PWM is kept in a ring
+ * of fixed size blocks, oldest overwritten first, and the whole ring can be
+ * read in one go from debugfs. Samples are delta encoded so a steady fan
+ * costs a fraction of a byte per sample. Block layout, all little endian:
+ *
+ *   u64 start_ms	real time of the first sample, in ms
+ *   u16 len		bytes of records following the header
+ *   u16 interval_ms	expected time between samples
+ *   u16 rpm		fan speed of the first sample
+ *   u8  pwm		PWM of the first sample, in EC units
+ *   u8  reserved
+ *   records...
+ *
+ * A record byte below 0x80 repeats the previous sample that many times,
+ * each interval_ms after the last. Otherwise its low bits say what follows
+ * as zigzag varints: bit 0 a time delta in ms replacing interval_ms, bit 1
+ * an RPM delta and bit 2 a PWM delta.
+ */
+#define OXP_HIST_BLOCK_SIZE	512
+#define OXP_HIST_RECORD_MAX	16
+#define OXP_HIST_REPEAT_MAX	0x7f
+
+#define OXP_HIST_TIME		BIT(0)
+#define OXP_HIST_RPM		BIT(1)
+#define OXP_HIST_PWM		BIT(2)
+
+struct oxp_hist_block {
+	__le64 start_ms;
+	__le16 len;
+	__le16 interval_ms;
+	__le16 rpm;
+	u8 pwm;
+	u8 reserved;
+	u8 data[OXP_HIST_BLOCK_SIZE - 16];
+};
+
+static unsigned int history_kb;
+module_param(history_kb, uint, 0444);
+MODULE_PARM_DESC(history_kb, "Memory for the fan history in KiB (0 to disable)");
+
+static struct {
+	struct oxp_hist_block *blocks;
+	unsigned int count;
+	unsigned int head;
+	unsigned int used;
+	int repeat_pos;
+	u64 last_ms;
+	u16 last_rpm;
+	u8 last_pwm;
+} oxp_hist;
+static DEFINE_MUTEX(oxp_hist_lock);
+
+static int oxp_hist_put_varint(u8 *p, s32 val)
+{
+	u32 zz = ((u32)val << 1) ^ (u32)(val >> 31);
+	int n = 0;
+
+	do {
+		p[n] = zz & 0x7f;
+		zz >>= 7;
+		if (zz)
+			p[n] |= 0x80;
+		n++;
+	} while (zz);
+
+	return n;
+}
+
+static void oxp_hist_new_block(u64 now_ms, u32 interval_ms, u16 rpm, u8 pwm)
+{
+	struct oxp_hist_block *b;
+
+	if (oxp_hist.used)
+		oxp_hist.head = (oxp_hist.head + 1) % oxp_hist.count;
+	oxp_hist.used = min(oxp_hist.used + 1, oxp_hist.count);
+
+	b = &oxp_hist.blocks[oxp_hist.head];
+	memset(b, 0, sizeof(*b));
+	b->start_ms = cpu_to_le64(now_ms);
+	b->interval_ms = cpu_to_le16(interval_ms);
+	b->rpm = cpu_to_le16(rpm);
+	b->pwm = pwm;
+
+	oxp_hist.repeat_pos = -1;
+	oxp_hist.last_ms = now_ms;
+	oxp_hist.last_rpm = rpm;
+	oxp_hist.last_pwm = pwm;
+}
+
+static void oxp_history_add(u16 rpm, u8 pwm)
+{
+	u64 now_ms = div_u64(ktime_get_real_ns(), NSEC_PER_MSEC);
+	u32 interval_ms = min(max(READ_ONCE(sample_interval_ms), OXP_SAMPLE_MIN_MS),
+			      (unsigned int)U16_MAX);
+	struct oxp_hist_block *b;
+	s64 dt, slack;
+	bool regular;
+	int len, n;
+	u8 *rec;
+
+	if (!oxp_hist.blocks)
+		return;
+
+	mutex_lock(&oxp_hist_lock);
+	b = &oxp_hist.blocks[oxp_hist.head];
+	len = le16_to_cpu(b->len);
+	dt = now_ms - oxp_hist.last_ms;
+
+	if (!oxp_hist.used || le16_to_cpu(b->interval_ms) != interval_ms ||
+	    len + OXP_HIST_RECORD_MAX > sizeof(b->data) ||
+	    dt < 0 || dt > S32_MAX) {
+		oxp_hist_new_block(now_ms, interval_ms, rpm, pwm);
+		goto out;
+	}
+
+	/*
+	 * Samples within an eighth of the interval of the expected time are
+	 * stored as regular; the expected time, not the real one, becomes the
+	 * reference so rounding never accumulates.
+	 */
+	slack = dt - interval_ms;
+	regular = abs(slack) <= interval_ms / 8;
+	oxp_hist.last_ms = regular ? oxp_hist.last_ms + interval_ms : now_ms;
+
+	if (regular && rpm == oxp_hist.last_rpm && pwm == oxp_hist.last_pwm) {
+		if (oxp_hist.repeat_pos >= 0 &&
+		    b->data[oxp_hist.repeat_pos] < OXP_HIST_REPEAT_MAX) {
+			b->data[oxp_hist.repeat_pos]++;
+		} else {
+			oxp_hist.repeat_pos = len;
+			b->data[len++] = 1;
+		}
+	} else {
+		rec = &b->data[len];
+		rec[0] = 0x80;
+		n = 1;
+		if (!regular) {
+			rec[0] |= OXP_HIST_TIME;
+			n += oxp_hist_put_varint(&rec[n], dt);
+		}
+		if (rpm != oxp_hist.last_rpm) {
+			rec[0] |= OXP_HIST_RPM;
+			n += oxp_hist_put_varint(&rec[n], rpm - oxp_hist.last_rpm);
+		}
+		if (pwm != oxp_hist.last_pwm) {
+			rec[0] |= OXP_HIST_PWM;
+			n += oxp_hist_put_varint(&rec[n], pwm - oxp_hist.last_pwm);
+		}
+		len += n;
+		oxp_hist.repeat_pos = -1;
+		oxp_hist.last_rpm = rpm;
+		oxp_hist.last_pwm = pwm;
+	}
+	b->len = cpu_to_le16(len);
+
+out:
+	mutex_unlock(&oxp_hist_lock);
+}
+
+static void oxp_history_free(void *data)
+{
+	mutex_lock(&oxp_hist_lock);
+	vfree(oxp_hist.blocks);
+	memset(&oxp_hist, 0, sizeof(oxp_hist));
+	mutex_unlock(&oxp_hist_lock);
+}
+
+static int oxp_history_init(struct device *dev)
+{
+	unsigned int count = history_kb * 1024 / sizeof(struct oxp_hist_block);
+
+	if (!count)
+		return 0;
+
+	oxp_hist.blocks = vzalloc(array_size(count, sizeof(struct oxp_hist_block)));
+	if (!oxp_hist.blocks)
+		return -ENOMEM;
+	oxp_hist.count = count;
+
+	return devm_add_action_or_reset(dev, oxp_history_free, NULL);
+}
+
+/*
+ * State estimator
+ * Between sampler ticks the fan speed and the fused temperature are
+ * predicted by scalar Kalman filters in integer arithmetic, and corrected by
+ * every tick. The fan is modelled as a first order lag towards a speed
+ * proportional to the last known PWM, with the gain learned from samples
+ * taken at a steady duty; the temperature follows its smoothed trend. The
+ * variance grows with the time since the last sample, so the reported
+ * standard deviation tells how far the estimate can be trusted. Consumers
+ * get smooth, current values while the EC is sampled slowly.
+ */
+#define OXP_EST_RPM_TAU_MS	2000
+#define OXP_EST_RPM_Q		10		/* rpm^2 per ms */
+#define OXP_EST_RPM_R		2500		/* rpm^2 */
+#define OXP_EST_TEMP_Q		100		/* mC^2 per ms */
+#define OXP_EST_TEMP_R		250000		/* mC^2 */
+#define OXP_EST_VAR_MAX		10000000000LL
+
+struct oxp_est {
+	s64 x;
+	s64 var;
+	s64 rate;	/* per second, temperature only */
+	u64 stamp_ns;
+	bool valid;
+};
+
+static struct {
+	struct oxp_est rpm;
+	struct oxp_est temp;
+	s64 gain;	/* rpm per PWM step, 8 fractional bits */
+	int last_pwm;
+} oxp_est;
+static DEFINE_SPINLOCK(oxp_est_lock);
+
+static s64 oxp_est_dt_ms(const struct oxp_est *e, u64 now)
+{
+	return now > e->stamp_ns ? div_u64(now - e->stamp_ns, NSEC_PER_MSEC) : 0;
+}
+
+static s64 oxp_est_rpm(u64 now, s64 *var)
+{
+	struct oxp_est *e = &oxp_est.rpm;
+	s64 dt = oxp_est_dt_ms(e, now);
+	s64 target = e->x;
+	long pwm;
+
+	lockdep_assert_held(&oxp_est_lock);
+
+	if (oxp_est.gain && oxp_cache_peek(OXP_SENSOR_PWM_REG, &pwm))
+		target = (oxp_est.gain * pwm) >> 8;
+
+	*var = min(e->var + OXP_EST_RPM_Q * dt, OXP_EST_VAR_MAX);
+
+	return max(target + div64_s64((e->x - target) * OXP_EST_RPM_TAU_MS,
+				      OXP_EST_RPM_TAU_MS + dt), 0LL);
+}
+
+static s64 oxp_est_temp(u64 now, s64 *var)
+{
+	struct oxp_est *e = &oxp_est.temp;
+	s64 dt = oxp_est_dt_ms(e, now);
+
+	lockdep_assert_held(&oxp_est_lock);
+
+	*var = min(e->var + OXP_EST_TEMP_Q * dt, OXP_EST_VAR_MAX);
+
+	return e->x + div_s64(e->rate * dt, MSEC_PER_SEC);
+}
+
+static void oxp_est_correct(struct oxp_est *e, s64 pred, s64 var, s64 z,
+			    s64 r, u64 now)
+{
+	if (e->valid) {
+		e->x = pred + div64_s64((z - pred) * var, var + r);
+		e->var = div64_s64(var * r, var + r);
+	} else {
+		e->x = z;
+		e->var = r;
+		e->valid = true;
+	}
+	e->stamp_ns = now;
+}
+
+static void oxp_est_update_rpm(u16 rpm, int pwm, u64 now)
+{
+	s64 pred, var, gain;
+
+	spin_lock(&oxp_est_lock);
+	pred = oxp_est_rpm(now, &var);
+	oxp_est_correct(&oxp_est.rpm, pred, var, rpm, OXP_EST_RPM_R, now);
+
+	if (pwm > 0 && pwm == oxp_est.last_pwm) {
+		gain = div_s64((s64)rpm << 8, pwm);
+		oxp_est.gain += oxp_est.gain ? (gain - oxp_est.gain) / 8 : gain;
+	}
+	oxp_est.last_pwm = pwm;
+	spin_unlock(&oxp_est_lock);
+}
+
+static void oxp_est_update_temp(long temp, u64 now)
+{
+	struct oxp_est *e = &oxp_est.temp;
+	s64 pred, var, dt;
+
+	spin_lock(&oxp_est_lock);
+	pred = oxp_est_temp(now, &var);
+	dt = oxp_est_dt_ms(e, now);
+	if (e->valid && dt)
+		e->rate += (div64_s64((temp - e->x) * MSEC_PER_SEC, dt) - e->rate) / 4;
+	oxp_est_correct(e, pred, var, temp, OXP_EST_TEMP_R, now);
+	spin_unlock(&oxp_est_lock);
+}
+
+/* Callbacks for fan1_estimate, temp1_estimate and their _stddev attributes */
+static ssize_t estimate_show(struct device *dev, struct device_attribute *attr,
+			     char *buf)
+{
+	int idx = to_sensor_dev_attr(attr)->index;
+	bool temp = idx & 2;
+	u64 now = ktime_get_ns();
+	s64 x = 0, var = 0;
+	bool valid;
+
+	spin_lock(&oxp_est_lock);
+	valid = temp ? oxp_est.temp.valid : oxp_est.rpm.valid;
+	if (valid)
+		x = temp ? oxp_est_temp(now, &var) : oxp_est_rpm(now, &var);
+	spin_unlock(&oxp_est_lock);
+
+	if (!valid)
+		return -ENODATA;
+
+	oxp_iface_account(OXP_IFACE_ESTIMATE, now);
+
+	return sysfs_emit(buf, "%lld\n", idx & 1 ? (s64)int_sqrt64(var) : x);
+}
+
+static SENSOR_DEVICE_ATTR_RO(fan1_estimate, estimate, 0);
+static SENSOR_DEVICE_ATTR_RO(fan1_estimate_stddev, estimate, 1);
+static SENSOR_DEVICE_ATTR_RO(temp1_estimate, estimate, 2);
+static SENSOR_DEVICE_ATTR_RO(temp1_estimate_stddev, estimate, 3);
+
+/*
+ * Register watchpoints
+ * For board bring-up, a list of EC registers set through debugfs is read by
+ * the sampler in the same batch as the fan registers. Every change is
+ * logged with its timestamp to a small ring, which turns finding the offset
+ * behind a button or mode switch into a cheap kernel-side diff. Both are
+ * protected by oxp_ctl_lock.
+ */
+#define OXP_WATCH_MAX		32
+#define OXP_WATCH_EVENTS	256
+
+struct oxp_watch_event {
+	u64 timestamp_ns;
+	u8 reg;
+	u8 old_val;
+	u8 new_val;
+};
+
+static struct {
+	u8 regs[OXP_WATCH_MAX];
+	u8 vals[OXP_WATCH_MAX];
+	unsigned int count;
+	bool primed;
+	u64 head;
+	struct oxp_watch_event ring[OXP_WATCH_EVENTS];
+} oxp_watch;
+
+static void oxp_watch_update(const u8 *vals, u64 now)
+{
+	struct oxp_watch_event *e;
+	unsigned int i;
+
+	lockdep_assert_held(&oxp_ctl_lock);
+
+	for (i = 0; i < oxp_watch.count; i++) {
+		if (oxp_watch.primed && vals[i] != oxp_watch.vals[i]) {
+			e = &oxp_watch.ring[oxp_watch.head++ % OXP_WATCH_EVENTS];
+			e->timestamp_ns = now;
+			e->reg = oxp_watch.regs[i];
+			e->old_val = oxp_watch.vals[i];
+			e->new_val = vals[i];
+		}
+		oxp_watch.vals[i] = vals[i];
+	}
+	oxp_watch.primed = true;
+}
+
+/*
+ * Change notifications
+ * While the sampler runs, changes it sees in the PWM and fan speed changes
+ * of at least OXP_NOTIFY_RPM_DELTA are notified on pwm1 and fan1_input, so
+ * userspace can poll() them instead of rereading at a fixed rate. Only
+ * sysfs is notified: the tach value moves on nearly every sample and a
+ * uevent each time would cost more than it saves. Protected by
+ * oxp_ctl_lock.
+ */
+#define OXP_NOTIFY_RPM_DELTA	100
+
+static struct device *oxp_hwmon_dev;
+
+static struct {
+	int rpm;
+	int pwm;
+} oxp_notified;
+
+static void oxp_notify_update(int rpm, int pwm)
+{
+	lockdep_assert_held(&oxp_ctl_lock);
+
+	if (!oxp_hwmon_dev)
+		return;
+
+	if (rpm >= 0 && abs(rpm - oxp_notified.rpm) >= OXP_NOTIFY_RPM_DELTA) {
+		if (oxp_notified.rpm >= 0)
+			sysfs_notify(&oxp_hwmon_dev->kobj, NULL, "fan1_input");
+		oxp_notified.rpm = rpm;
+	}
+	if (pwm >= 0 && pwm != oxp_notified.pwm) {
+		if (oxp_notified.pwm >= 0)
+			sysfs_notify(&oxp_hwmon_dev->kobj, NULL, "pwm1");
+		oxp_notified.pwm = pwm;
+	}
+}
+
+static void oxp_hwmon_unpublish(void *data)
+{
+	mutex_lock(&oxp_ctl_lock);
+	oxp_hwmon_dev = NULL;
+	mutex_unlock(&oxp_ctl_lock);
+}
+
+/*
+ * Background sampler
+ * Fan policies are driven from a periodic tick that reads every fan register
+ * in a single batch and then writes at most the PWM. It only runs while some
+ * policy needs it. Ticks are scheduled at fixed-rate deadlines; their start
+ * jitter and duration are accounted, and a tick that ends after the next
+ * deadline counts as missed and skips that slot.
+ *
+ * By default ticks run on an unbound workqueue, so they stay on the
+ * housekeeping CPUs and off isolated ones; its CPU mask can be narrowed
+ * further in /sys/devices/virtual/workqueue/oxp-sensors/cpumask. With
+ * sampler_rt set they run instead on a SCHED_FIFO kthread woken by an
+ * hrtimer, which keeps the timing tight under heavy CPU load. That kthread
+ * is bound to the housekeeping CPUs explicitly, since plain isolcpus= does
+ * not restrict kthreads; the workqueue cpumask does not apply to it.
+ *
+ * With sample_slack_ms set, periodic ticks may run up to that late so EC
+ * wakeups bunch together: a tick whose deadline has passed runs right after
+ * the next EC transaction made for a reader, and the RT timer is armed with
+ * that slack so it can expire along with other timers. There is no hook for
+ * EC transactions of other drivers or the firmware, so only the driver's
+ * own traffic is coalesced.
+ */
+static bool sampler_rt;
+module_param(sampler_rt, bool, 0444);
+MODULE_PARM_DESC(sampler_rt, "Run fan policies from a real-time kthread");
+
+static unsigned int sample_slack_ms;
+module_param(sample_slack_ms, uint, 0644);
+MODULE_PARM_DESC(sample_slack_ms, "Delay allowed for periodic ticks to share EC wakeups (ms)");
+
+static struct workqueue_struct *oxp_wq;
+static struct kthread_worker *oxp_rt_worker;
+static struct hrtimer oxp_rt_timer;
+static bool oxp_sampler_live;	/* between init and stop */
+static bool oxp_sampler_on;
+static atomic_t oxp_sampler_slack;	/* waiting in a slack window */
+static u64 oxp_sampler_due_ns;
+static u64 oxp_sampler_regular_ns;	/* next tick on the sample_interval_ms schedule */
+
+static void oxp_sampler_work_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(oxp_sampler_work, oxp_sampler_work_fn);
+static void oxp_rt_work_fn(struct kthread_work *work);
+static DEFINE_KTHREAD_WORK(oxp_rt_work, oxp_rt_work_fn);
+
+static u64 oxp_sample_period_ns(void)
+{
+	return (u64)max(READ_ONCE(sample_interval_ms), OXP_SAMPLE_MIN_MS) * NSEC_PER_MSEC;
+}
+
+/*
+ * Whether a control policy needs the fan and PWM registers every tick,
+ * including one last tick to restore the duty after it is switched off.
+ */
+static bool oxp_ctl_active(void)
+{
+	lockdep_assert_held(&oxp_ctl_lock);
+
+	return oxp_ctl.max_rpm || oxp_ctl.took_over || oxp_budget.setpoint ||
+	       oxp_ctl.ceiling != INT_MAX || oxp_ff.boost ||
+	       (READ_ONCE(ff_boost) && oxp_ctl.pwm_request >= 0);
+}
+
+static bool oxp_sampler_needed(void)
+{
+	lockdep_assert_held(&oxp_ctl_lock);
+
+	return oxp_ctl_active() || oxp_hist.blocks || oxp_watch.count ||
+	       READ_ONCE(sample_phase_lock);
+}
+
+/* Schedules the next tick at due_ns, or up to slack_ns later */
+static void oxp_sampler_arm_range(u64 due_ns, u64 slack_ns)
+{
+	u64 now = ktime_get_ns();
+	u64 latest = due_ns + slack_ns;
+
+	lockdep_assert_held(&oxp_ctl_lock);
+
+	if (!oxp_sampler_live)
+		return;
+
+	oxp_sampler_on = true;
+	WRITE_ONCE(oxp_sampler_due_ns, due_ns);
+	atomic_set(&oxp_sampler_slack, slack_ns != 0);
+	if (oxp_rt_worker)
+		hrtimer_start_range_ns(&oxp_rt_timer, ns_to_ktime(due_ns),
+				       slack_ns, HRTIMER_MODE_ABS);
+	else
+		mod_delayed_work(oxp_wq, &oxp_sampler_work,
+				 latest > now ? nsecs_to_jiffies(latest - now) : 0);
+}
+
+static void oxp_sampler_arm(u64 due_ns)
+{
+	oxp_sampler_arm_range(due_ns, 0);
+}
+
+static void oxp_cadence_update(u16 rpm, u64 now)
+{
+	lockdep_assert_held(&oxp_ctl_lock);
+
+	if (!READ_ONCE(sample_phase_lock)) {
+		oxp_cadence.probes = 0;
+		oxp_cadence.period_ns = 0;
+		oxp_cadence.ticks = OXP_CADENCE_REDETECT_TICKS;
+		return;
+	}
+
+	if (!oxp_cadence.probes) {
+		if (++oxp_cadence.ticks < OXP_CADENCE_REDETECT_TICKS)
+			return;
+
+		oxp_cadence.probes = OXP_CADENCE_PROBES;
+		oxp_cadence.changes = 0;
+		oxp_cadence.ticks = 0;
+		oxp_cadence.last_rpm = rpm;
+		oxp_cadence.last_change_ns = 0;
+		oxp_cadence.min_interval_ns = U64_MAX;
+		return;
+	}
+
+	if (rpm != oxp_cadence.last_rpm) {
+		if (oxp_cadence.last_change_ns)
+			oxp_cadence.min_interval_ns =
+				min(oxp_cadence.min_interval_ns,
+				    now - oxp_cadence.last_change_ns);
+		oxp_cadence.last_change_ns = now;
+		oxp_cadence.last_rpm = rpm;
+		oxp_cadence.changes++;
+	}
+
+	if (--oxp_cadence.probes)
+		return;
+
+	/* A stopped or perfectly steady fan tells nothing, retry later */
+	if (oxp_cadence.changes >= OXP_CADENCE_MIN_CHANGES) {
+		WRITE_ONCE(oxp_cadence.period_ns, oxp_cadence.min_interval_ns);
+		oxp_cadence.phase_ns = oxp_cadence.last_change_ns;
+	}
+}
+
+/* First expected EC refresh at or after t, plus a margin for the EC to settle */
+static u64 oxp_cadence_align(u64 t)
+{
+	u64 period = oxp_cadence.period_ns;
+	u64 first = oxp_cadence.phase_ns + period / 8;
+
+	if (t <= first)
+		return first;
+
+	return first + div64_u64(t - first + period - 1, period) * period;
+}
+
+#define OXP_TICK_REGS	5
+
+static int oxp_fused_read(long *val);
+
+/*
+ * Reads what the active policies need plus the register groups in demand,
+ * which keeps their cached values fresh, in a single batch.
+ */
+static void oxp_sampler_tick(bool regular)
+{
+	bool ctl = (regular || oxp_ctl.probing) && oxp_ctl_active();
+	bool hist = regular && oxp_hist.blocks;
+	u8 regs[OXP_TICK_REGS + OXP_WATCH_MAX];
+	u8 vals[ARRAY_SIZE(regs)];
+	int fan = -1, enable = -1, pwm = -1;
+	int n = 0, watch;
+	bool temp_valid;
+	u16 rpm = 0;
+	long temp = 0;
+	u64 now;
+
+	if (ctl || hist || READ_ONCE(sample_phase_lock) ||
+	    oxp_demanded(OXP_PATH_FAN)) {
+		fan = n;
+		regs[n++] = OXP_SENSOR_FAN_REG;
+		regs[n++] = OXP_SENSOR_FAN_REG + 1;
+	}
+	if (ctl || oxp_demanded(OXP_PATH_PWM_ENABLE)) {
+		enable = n;
+		regs[n++] = OXP_SENSOR_PWM_ENABLE_REG;
+	}
+	if (ctl || hist || oxp_demanded(OXP_PATH_PWM)) {
+		pwm = n;
+		regs[n++] = OXP_SENSOR_PWM_REG;
+	}
+	if (board_info->turbo_reg && oxp_demanded(OXP_PATH_TURBO))
+		regs[n++] = board_info->turbo_reg;
+	watch = n;
+	memcpy(&regs[n], oxp_watch.regs, oxp_watch.count);
+	n += oxp_watch.count;
+
+	if (n && read_from_ec_batch(regs, vals, n))
+		return;
+
+	now = ktime_get_ns();
+	atomic64_inc(&oxp_stats.sampler_ticks);
+	if (fan >= 0) {
+		rpm = (vals[fan] << 8) | vals[fan + 1];
+		oxp_est_update_rpm(rpm, pwm >= 0 ? vals[pwm] : -1, now);
+	}
+	temp_valid = !oxp_fused_read(&temp);
+	if (temp_valid)
+		oxp_est_update_temp(temp, now);
+	oxp_notify_update(fan >= 0 ? rpm : -1, pwm >= 0 ? vals[pwm] : -1);
+	oxp_watch_update(&vals[watch], now);
+	oxp_cadence_update(rpm, now);
+	if (hist)
+		oxp_history_add(rpm, vals[pwm]);
+	if (ctl) {
+		oxp_budget_update(temp, temp_valid, now);
+		oxp_ctl_update(rpm, vals[enable], vals[pwm]);
+	}
+}
+
+static void oxp_sampler_run(void)
+{
+	u64 due = READ_ONCE(oxp_sampler_due_ns);
+	u64 start = ktime_get_ns();
+	u64 end, next;
+	bool regular;
+
+	oxp_latency_add(&oxp_stats.tick_jitter, start > due ? start - due : 0);
+
+	mutex_lock(&oxp_ctl_lock);
+	atomic_set(&oxp_sampler_slack, 0);
+	if (!oxp_sampler_live || READ_ONCE(oxp_shutting_down)) {
+		oxp_sampler_on = false;
+		mutex_unlock(&oxp_ctl_lock);
+		return;
+	}
+
+	/* Cadence probes in between regular ticks leave the policies alone */
+	regular = start >= oxp_sampler_regular_ns;
+	oxp_sampler_tick(regular);
+	end = ktime_get_ns();
+	oxp_latency_add(&oxp_stats.tick_duration, end - start);
+
+	if (regular) {
+		due = max(due, oxp_sampler_regular_ns);
+		if (end > due + oxp_sample_period_ns()) {
+			atomic64_inc(&oxp_stats.ticks_missed);
+			due = end;
+		}
+		oxp_sampler_regular_ns = due + oxp_sample_period_ns();
+	}
+
+	next = oxp_sampler_regular_ns;
+	if (oxp_ctl.probing)
+		next = end + OXP_LIMIT_PROBE_MS * NSEC_PER_MSEC;
+	else if (oxp_cadence.probes)
+		next = end + OXP_CADENCE_PROBE_MS * NSEC_PER_MSEC;
+	else if (oxp_cadence.period_ns)
+		next = oxp_cadence_align(next);
+
+	if (!oxp_sampler_needed())
+		oxp_sampler_on = false;
+	else if (oxp_ctl.probing || oxp_cadence.probes || oxp_cadence.period_ns)
+		oxp_sampler_arm(next);
+	else
+		oxp_sampler_arm_range(next, min_t(u64, READ_ONCE(sample_slack_ms) * NSEC_PER_MSEC,
+						  oxp_sample_period_ns() / 2));
+	mutex_unlock(&oxp_ctl_lock);
+}
+
+static void oxp_sampler_work_fn(struct work_struct *work)
+{
+	oxp_sampler_run();
+}
+
+static void oxp_rt_work_fn(struct kthread_work *work)
+{
+	oxp_sampler_run();
+}
+
+static enum hrtimer_restart oxp_rt_timer_fn(struct hrtimer *timer)
+{
+	kthread_queue_work(oxp_rt_worker, &oxp_rt_work);
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Called after EC transactions made for readers: runs a tick that is past
+ * its deadline and only waiting in its slack window now, while the EC is
+ * awake anyway. The tick is requeued under oxp_ctl_lock so it cannot race
+ * with oxp_sampler_stop(); if the lock is busy the tick simply runs from its
+ * own timer.
+ */
+static void oxp_sampler_coalesce(void)
+{
+	if (!atomic_read(&oxp_sampler_slack) ||
+	    ktime_get_ns() < READ_ONCE(oxp_sampler_due_ns) ||
+	    !mutex_trylock(&oxp_ctl_lock))
+		return;
+
+	if (!oxp_sampler_live || !atomic_xchg(&oxp_sampler_slack, 0))
+		goto out;
+
+	if (oxp_rt_worker) {
+		if (hrtimer_try_to_cancel(&oxp_rt_timer) != 1)
+			goto out;
+		kthread_queue_work(oxp_rt_worker, &oxp_rt_work);
+	} else {
+		if (!cancel_delayed_work(&oxp_sampler_work))
+			goto out;
+		queue_delayed_work(oxp_wq, &oxp_sampler_work, 0);
+	}
+	atomic64_inc(&oxp_stats.ticks_coalesced);
+out:
+	mutex_unlock(&oxp_ctl_lock);
+}
+
+/* Runs a tick right away, for policy changes */
+static void oxp_sampler_kick(void)
+{
+	lockdep_assert_held(&oxp_ctl_lock);
+
+	oxp_sampler_arm(ktime_get_ns());
+}
+
+/* Starts the sampler if needed, without disturbing a running one */
+static void oxp_sampler_ensure(void)
+{
+	lockdep_assert_held(&oxp_ctl_lock);
+
+	if (!oxp_sampler_on && oxp_sampler_needed())
+		oxp_sampler_arm(ktime_get_ns() + oxp_sample_period_ns());
+}
+
+/* Sampler parameters take effect without waiting for another policy change */
+static void oxp_sampler_param_changed(void)
+{
+	mutex_lock(&oxp_ctl_lock);
+	oxp_sampler_ensure();
+	mutex_unlock(&oxp_ctl_lock);
+}
+
+static int oxp_sampler_param_set_bool(const char *val,
+				      const struct kernel_param *kp)
+{
+	int ret = param_set_bool(val, kp);
+
+	if (!ret)
+		oxp_sampler_param_changed();
+
+	return ret;
+}
+
+static int oxp_sampler_param_set_uint(const char *val,
+				      const struct kernel_param *kp)
+{
+	int ret = param_set_uint(val, kp);
+
+	if (!ret)
+		oxp_sampler_param_changed();
+
+	return ret;
+}
+
+static void oxp_sampler_stop(void *data)
+{
+	/* Nothing can arm the sampler past this point */
+	mutex_lock(&oxp_ctl_lock);
+	oxp_sampler_live = false;
+	oxp_sampler_on = false;
+	atomic_set(&oxp_sampler_slack, 0);
+	mutex_unlock(&oxp_ctl_lock);
+
+	if (oxp_rt_worker) {
+		hrtimer_cancel(&oxp_rt_timer);
+		kthread_cancel_work_sync(&oxp_rt_work);
+	} else {
+		cancel_delayed_work_sync(&oxp_sampler_work);
+	}
+
+	mutex_lock(&oxp_ctl_lock);
+	oxp_limit_release();
+	mutex_unlock(&oxp_ctl_lock);
+}
+
+static void oxp_sampler_destroy(void *data)
+{
+	if (oxp_rt_worker)
+		kthread_destroy_worker(oxp_rt_worker);
+	destroy_workqueue(oxp_wq);
+}
+
+static int oxp_sampler_init(struct device *dev)
+{
+	int ret;
+
+	oxp_wq = alloc_workqueue("oxp-sensors", WQ_UNBOUND | WQ_SYSFS, 0);
+	if (!oxp_wq)
+		return -ENOMEM;
+
+	if (sampler_rt) {
+		oxp_rt_worker = kthread_create_worker(0, "oxp-sensors");
+		if (IS_ERR(oxp_rt_worker)) {
+			destroy_workqueue(oxp_wq);
+			return PTR_ERR(oxp_rt_worker);
+		}
+		set_cpus_allowed_ptr(oxp_rt_worker->task,
+				     housekeeping_cpumask(HK_TYPE_DOMAIN));
+		sched_set_fifo_low(oxp_rt_worker->task);
+		hrtimer_init(&oxp_rt_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+		oxp_rt_timer.function = oxp_rt_timer_fn;
+	}
+
+	ret = devm_add_action_or_reset(dev, oxp_sampler_destroy, NULL);
+	if (ret)
+		return ret;
+
+	mutex_lock(&oxp_ctl_lock);
+	oxp_sampler_live = true;
+	mutex_unlock(&oxp_ctl_lock);
+
+	return 0;
+}
+
+/* Callbacks for fan1_max_target attribute */
+static ssize_t fan1_max_target_store(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t count)
+{
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	mutex_lock(&oxp_ctl_lock);
+	oxp_ctl.max_rpm = val;
+	oxp_sampler_kick();
+	mutex_unlock(&oxp_ctl_lock);
+
+	return count;
+}
+
+static ssize_t fan1_max_target_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%u\n", READ_ONCE(oxp_ctl.max_rpm));
+}
+
+static DEVICE_ATTR_RW(fan1_max_target);
+
+/* Callbacks for fan1_budget_* attributes */
+static ssize_t fan1_budget_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	int idx = to_sensor_dev_attr(attr)->index;
+	bool was_enabled;
+	long val;
+	int ret;
+
+	ret = kstrtol(buf, 10, &val);
+	if (ret)
+		return ret;
+
+	switch (idx) {
+	case OXP_BUDGET_SIZE:
+		if (val <= 0)
+			return -EINVAL;
+		break;
+	case OXP_BUDGET_PWM_MIN:
+	case OXP_BUDGET_PWM_MAX:
+		if (val < 0 || val > 255)
+			return -EINVAL;
+		break;
+	default:
+		break;
+	}
+
+	mutex_lock(&oxp_ctl_lock);
+	if ((idx == OXP_BUDGET_PWM_MIN && val > oxp_budget.pwm_max) ||
+	    (idx == OXP_BUDGET_PWM_MAX && val < oxp_budget.pwm_min)) {
+		mutex_unlock(&oxp_ctl_lock);
+		return -EINVAL;
+	}
+
+	was_enabled = oxp_budget.setpoint;
+	switch (idx) {
+	case OXP_BUDGET_SETPOINT:
+		if (val != oxp_budget.setpoint) {
+			oxp_budget.setpoint = val;
+			oxp_budget.used = 0;
+			oxp_budget.last_ns = 0;
+		}
+		break;
+	case OXP_BUDGET_SIZE:
+		oxp_budget.size = val;
+		break;
+	case OXP_BUDGET_PWM_MIN:
+		oxp_budget.pwm_min = val;
+		break;
+	case OXP_BUDGET_PWM_MAX:
+		oxp_budget.pwm_max = val;
+		break;
+	default:
+		break;
+	}
+
+	/* Hand the duty back to the last pwm1 write */
+	if (was_enabled && !oxp_budget.setpoint && oxp_ctl.pwm_request >= 0)
+		write_to_ec_changed(OXP_SENSOR_PWM_REG,
+				    min(oxp_ctl_demand(), oxp_ctl.ceiling));
+	oxp_sampler_kick();
+	mutex_unlock(&oxp_ctl_lock);
+
+	return count;
+}
+
+static ssize_t fan1_budget_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	int idx = to_sensor_dev_attr(attr)->index;
+	long val;
+
+	mutex_lock(&oxp_ctl_lock);
+	switch (idx) {
+	case OXP_BUDGET_SETPOINT:
+		val = oxp_budget.setpoint;
+		break;
+	case OXP_BUDGET_SIZE:
+		val = oxp_budget.size;
+		break;
+	case OXP_BUDGET_PWM_MIN:
+		val = oxp_budget.pwm_min;
+		break;
+	case OXP_BUDGET_PWM_MAX:
+		val = oxp_budget.pwm_max;
+		break;
+	default:
+		val = div_s64(oxp_budget.used, MSEC_PER_SEC);
+		break;
+	}
+	mutex_unlock(&oxp_ctl_lock);
+
+	return sysfs_emit(buf, "%ld\n", val);
+}
+
+static SENSOR_DEVICE_ATTR_RW(fan1_budget_setpoint, fan1_budget, OXP_BUDGET_SETPOINT);
+static SENSOR_DEVICE_ATTR_RW(fan1_budget_size, fan1_budget, OXP_BUDGET_SIZE);
+static SENSOR_DEVICE_ATTR_RW(fan1_budget_pwm_min, fan1_budget, OXP_BUDGET_PWM_MIN);
+static SENSOR_DEVICE_ATTR_RW(fan1_budget_pwm_max, fan1_budget, OXP_BUDGET_PWM_MAX);
+static SENSOR_DEVICE_ATTR_RO(fan1_budget_used, fan1_budget, OXP_BUDGET_USED);
+
+/*
+ * All fan state in a single read and a single batched EC transaction, for
+ * consumers polling several attributes every tick. One "name value" pair
+ * per line, named and scaled like the individual attributes.
+ */
+static ssize_t snapshot_show(struct device *dev, struct device_attribute *attr,
+			     char *buf)
+{
+	u8 regs[] = {
+		OXP_SENSOR_FAN_REG,
+		OXP_SENSOR_FAN_REG + 1,
+		OXP_SENSOR_PWM_REG,
+		OXP_SENSOR_PWM_ENABLE_REG,
+		board_info->turbo_reg,
+	};
+	int count = board_info->turbo_reg ? ARRAY_SIZE(regs) : ARRAY_SIZE(regs) - 1;
+	u8 vals[ARRAY_SIZE(regs)];
+	u64 start = ktime_get_ns();
+	int len, ret;
+
+	ret = read_from_ec_batch_cached(OXP_IFACE_SNAPSHOT, regs, vals, count);
+	if (ret)
+		return ret;
+
+	len = sysfs_emit(buf, "fan1_input %u\n", (vals[0] << 8) | vals[1]);
+	len += sysfs_emit_at(buf, len, "pwm1 %u\n",
+			     vals[2] * 255 / oxp_pwm_max_raw());
+	len += sysfs_emit_at(buf, len, "pwm1_enable %u\n", vals[3]);
+	if (board_info->turbo_reg)
+		len += sysfs_emit_at(buf, len, "tt_toggle %d\n", !!vals[4]);
+
+	oxp_iface_account(OXP_IFACE_SNAPSHOT, start);
+
+	return len;
+}
+
+static DEVICE_ATTR_RO(snapshot);
+
+/*
+ * Fused temperature input
+ * Several thermal zones (APU, battery, skin...) can be combined into a single
+ * control temperature exposed as temp1_input. Each source has a weight in
+ * percent: in max mode the weight scales the source temperature before taking
+ * the hottest one, in blend mode it is used for a weighted mean. Sources can
+ * optionally be extrapolated by their rising rate of change so load spikes
+ * show up before the zone temperature actually gets there.
+ *
+ * Besides thermal zones, sources named virt1 to virt4 refer to virtual
+ * inputs written by userspace through temp_virtN_input, for temperatures
+ * only known there (GPU telemetry, skin estimators...). A virtual input that
+ * has not been written for virt_temp_timeout_ms is ignored.
+ */
+#define OXP_FUSED_MAX_SOURCES	4
+#define OXP_FUSED_SLOPE_MIN_NS	(100 * NSEC_PER_MSEC)
+
+static char fused_sources[128];
+module_param_string(fused_sources, fused_sources, sizeof(fused_sources), 0444);
+MODULE_PARM_DESC(fused_sources,
+		 "Thermal zone types fused into temp1_input, as type[:weight][,type[:weight]...]");
+
+#define OXP_VIRT_TEMPS		4
+
+static unsigned int virt_temp_timeout_ms = 5000;
+module_param(virt_temp_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(virt_temp_timeout_ms, "Time after which a virtual temperature input expires (ms)");
+
+static struct {
+	long temp;
+	unsigned long stamp;
+	bool valid;
+} oxp_virt_temps[OXP_VIRT_TEMPS];
+static DEFINE_SPINLOCK(oxp_virt_lock);
+
+static int oxp_virt_temp_get(int idx, int *temp)
+{
+	unsigned long timeout = msecs_to_jiffies(READ_ONCE(virt_temp_timeout_ms));
+	int ret = -ENODATA;
+
+	spin_lock(&oxp_virt_lock);
+	if (oxp_virt_temps[idx].valid &&
+	    time_before_eq(jiffies, oxp_virt_temps[idx].stamp + timeout)) {
+		*temp = oxp_virt_temps[idx].temp;
+		ret = 0;
+	}
+	spin_unlock(&oxp_virt_lock);
+
+	return ret;
+}
+
+static ssize_t temp_virt_input_store(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t count)
+{
+	int idx = to_sensor_dev_attr(attr)->index;
+	long val;
+	int ret;
+
+	ret = kstrtol(buf, 10, &val);
+	if (ret)
+		return ret;
+
+	spin_lock(&oxp_virt_lock);
+	oxp_virt_temps[idx].temp = clamp_val(val, -273150, 1000000);
+	oxp_virt_temps[idx].stamp = jiffies;
+	oxp_virt_temps[idx].valid = true;
+	spin_unlock(&oxp_virt_lock);
+
+	return count;
+}
+
+static ssize_t temp_virt_input_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	int idx = to_sensor_dev_attr(attr)->index;
+	int temp, ret;
+
+	ret = oxp_virt_temp_get(idx, &temp);
+	if (ret)
+		return ret;
+
+	return sysfs_emit(buf, "%d\n", temp);
+}
+
+static SENSOR_DEVICE_ATTR_RW(temp_virt1_input, temp_virt_input, 0);
+static SENSOR_DEVICE_ATTR_RW(temp_virt2_input, temp_virt_input, 1);
+static SENSOR_DEVICE_ATTR_RW(temp_virt3_input, temp_virt_input, 2);
+static SENSOR_DEVICE_ATTR_RW(temp_virt4_input, temp_virt_input, 3);
+
+static bool fused_blend;
+module_param(fused_blend, bool, 0644);
+MODULE_PARM_DESC(fused_blend, "Fuse sources as a weighted mean instead of a weighted max");
+
+static unsigned int fused_lookahead_ms;
+module_param(fused_lookahead_ms, uint, 0644);
+MODULE_PARM_DESC(fused_lookahead_ms,
+		 "Extrapolate rising sources by their rate of change over this time (ms)");
+
+struct oxp_temp_source {
+	char type[THERMAL_NAME_LENGTH];
+	int virt;		/* virtual input index, -1 for thermal zones */
+	unsigned int weight;
+	int last_temp;
+	u64 last_ns;
+	s64 slope; /* millidegrees per second */
+};
+
+static struct oxp_temp_source oxp_fused[OXP_FUSED_MAX_SOURCES];
+static int oxp_fused_count;
+static DEFINE_MUTEX(oxp_fused_lock);
+
+static int oxp_fused_parse(void)
+{
+	struct oxp_temp_source *src;
+	char *buf, *cur, *tok, *weight;
+	int ret = 0;
+
+	memset(oxp_fused, 0, sizeof(oxp_fused));
+	oxp_fused_count = 0;
+
+	buf = kstrdup(fused_sources, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	cur = buf;
+	while ((tok = strsep(&cur, ",")) && oxp_fused_count < OXP_FUSED_MAX_SOURCES) {
+		tok = strim(tok);
+		if (!*tok)
+			continue;
+
+		src = &oxp_fused[oxp_fused_count];
+		src->weight = 100;
+		weight = strchr(tok, ':');
+		if (weight) {
+			*weight++ = '\0';
+			ret = kstrtouint(weight, 10, &src->weight);
+			if (ret)
+				break;
+		}
+		strscpy(src->type, tok, sizeof(src->type));
+		src->virt = -1;
+		if (sscanf(src->type, "virt%d", &src->virt) != 1 ||
+		    src->virt < 1 || src->virt > OXP_VIRT_TEMPS)
+			src->virt = -1;
+		else
+			src->virt--;
+		oxp_fused_count++;
+	}
+
+	kfree(buf);
+	return ret;
+}
+
+/* Reads every source once and returns the fused temperature in millidegrees */
+static int oxp_fused_read(long *val)
+{
+	struct thermal_zone_device *tz;
+	struct oxp_temp_source *src;
+	s64 best = 0, sum = 0, weights = 0;
+	s64 temp_eff, slope;
+	u64 now = ktime_get_ns();
+	int i, temp, valid = 0;
+
+	mutex_lock(&oxp_fused_lock);
+	for (i = 0; i < oxp_fused_count; i++) {
+		src = &oxp_fused[i];
+		if (src->virt >= 0) {
+			if (oxp_virt_temp_get(src->virt, &temp))
+				continue;
+		} else {
+			tz = thermal_zone_get_zone_by_name(src->type);
+			if (IS_ERR(tz) || thermal_zone_get_temp(tz, &temp))
+				continue;
+		}
+
+		if (!src->last_ns) {
+			src->last_temp = temp;
+			src->last_ns = now;
+		} else if (now - src->last_ns >= OXP_FUSED_SLOPE_MIN_NS) {
+			slope = div64_s64((s64)(temp - src->last_temp) * NSEC_PER_SEC,
+					  now - src->last_ns);
+			src->slope = (src->slope + slope) / 2;
+			src->last_temp = temp;
+			src->last_ns = now;
+		}
+
+		/* Only feed forward rising temperatures */
+		temp_eff = temp;
+		if (src->slope > 0)
+			temp_eff += div_s64(src->slope * READ_ONCE(fused_lookahead_ms),
+					    MSEC_PER_SEC);
+
+		if (READ_ONCE(fused_blend)) {
+			sum += temp_eff * src->weight;
+			weights += src->weight;
+		} else {
+			temp_eff = div_s64(temp_eff * src->weight, 100);
+			if (!valid || temp_eff > best)
+				best = temp_eff;
+		}
+		valid++;
+	}
+	mutex_unlock(&oxp_fused_lock);
+
+	if (!valid)
+		return -ENODATA;
+
+	if (READ_ONCE(fused_blend))
+		*val = weights ? div64_s64(sum, weights) : 0;
+	else
+		*val = best;
+
+	return 0;
+}
+
+/* Callbacks for hwmon interface */
+static umode_t oxp_ec_hwmon_is_visible(const void *drvdata,
+				       enum hwmon_sensor_types type, u32 attr, int channel)
+{
+	switch (type) {
+	case hwmon_temp:
+		return oxp_fused_count ? 0444 : 0;
+	case hwmon_fan:
+		return 0444;
+	case hwmon_pwm:
+		return 0644;
+	default:
+		return 0;
+	}
+}
+
+static int oxp_hwmon_read(enum hwmon_sensor_types type, u32 attr, long *val)
 {
 	int ret;
 
 	switch (type) {
+	case hwmon_temp:
+		switch (attr) {
+		case hwmon_temp_input:
+			return oxp_fused_read(val);
+		default:
+			break;
+		}
+		break;
 	case hwmon_fan:
 		switch (attr) {
 		case hwmon_fan_input:
-			return read_from_ec(OXP_SENSOR_FAN_REG, 2, val);
+			return read_from_ec_cached(OXP_IFACE_HWMON,
+						   OXP_SENSOR_FAN_REG, 2, val);
+		default:
+			break;
+		}
+		break;
+	case hwmon_pwm:
+		switch (attr) {
+		case hwmon_pwm_input:
+			ret = read_from_ec_cached(OXP_IFACE_HWMON,
+						  OXP_SENSOR_PWM_REG, 1, val);
+			if (ret)
+				return ret;
+			*val = (*val * 255) / oxp_pwm_max_raw();
+			return 0;
+		case hwmon_pwm_enable:
+			return read_from_ec_cached(OXP_IFACE_HWMON,
+						   OXP_SENSOR_PWM_ENABLE_REG, 1, val);
+		default:
+			break;
+		}
+		break;
+	default:
+		break;
+	}
+	return -EOPNOTSUPP;
+}
+
+static int oxp_platform_read(struct device *dev, enum hwmon_sensor_types type,
+			     u32 attr, int channel, long *val)
+{
+	u64 start = ktime_get_ns();
+	int ret;
+
+	ret = oxp_hwmon_read(type, attr, val);
+	if (!ret)
+		oxp_iface_account(OXP_IFACE_HWMON, start);
+
+	return ret;
+}
+
+static int oxp_platform_read_string(struct device *dev,
+				    enum hwmon_sensor_types type, u32 attr,
+				    int channel, const char **str)
+{
+	switch (type) {
+	case hwmon_temp:
+		switch (attr) {
+		case hwmon_temp_label:
+			*str = "fused";
+			return 0;
+		default:
+			break;
+		}
+		break;
+	default:
+		break;
+	}
+	return -EOPNOTSUPP;
+}
+
+static int oxp_platform_write(struct device *dev, enum hwmon_sensor_types type,
+			      u32 attr, int channel, long val)
+{
+	switch (type) {
+	case hwmon_pwm:
+		switch (attr) {
+		case hwmon_pwm_enable:
+			if (val == 1)
+				return oxp_ctl_set_enable(true);
+			else if (val == 0)
+				return oxp_ctl_set_enable(false);
+			return -EINVAL;
+		case hwmon_pwm_input:
+			if (val < 0 || val > 255)
+				return -EINVAL;
+			return oxp_ctl_set_pwm(val);
 		default:
 			break;
 		}
-		break;
-	case hwmon_pwm:
-		switch (attr) {
-		case hwmon_pwm_input:
-			ret = read_from_ec(OXP_SENSOR_PWM_REG, 1, val);
-			if (ret)
-				return ret;
-			switch (board) {
-			case aya_neo_2:
-			case aya_neo_air:
-			case aya_neo_air_pro:
-			case aya_neo_geek:
-			case oxp_mini_amd:
-			case oxp_mini_amd_a07:
-				*val = (*val * 255) / 100;
-				break;
-			case oxp_mini_amd_pro:
-			case aok_zoe_a1:
-			default:
-				break;
-			}
-			return 0;
-		case hwmon_pwm_enable:
-			return read_from_ec(OXP_SENSOR_PWM_ENABLE_REG, 1, val);
-		default:
+		break;
+	default:
+		break;
+	}
+	return -EOPNOTSUPP;
+}
+
+/* Known sensors in the OXP EC controllers */
+static const struct hwmon_channel_info * const oxp_platform_sensors[] = {
+	HWMON_CHANNEL_INFO(temp,
+			   HWMON_T_INPUT | HWMON_T_LABEL),
+	HWMON_CHANNEL_INFO(fan,
+			   HWMON_F_INPUT),
+	HWMON_CHANNEL_INFO(pwm,
+			   HWMON_PWM_INPUT | HWMON_PWM_ENABLE),
+	NULL,
+};
+
+static struct attribute *oxp_ec_attrs[] = {
+	&dev_attr_tt_toggle.attr,
+	NULL
+};
+
+ATTRIBUTE_GROUPS(oxp_ec);
+
+static struct attribute *oxp_ctl_attrs[] = {
+	&dev_attr_fan1_max_target.attr,
+	&dev_attr_snapshot.attr,
+	&sensor_dev_attr_fan1_budget_setpoint.dev_attr.attr,
+	&sensor_dev_attr_fan1_budget_size.dev_attr.attr,
+	&sensor_dev_attr_fan1_budget_pwm_min.dev_attr.attr,
+	&sensor_dev_attr_fan1_budget_pwm_max.dev_attr.attr,
+	&sensor_dev_attr_fan1_budget_used.dev_attr.attr,
+	&sensor_dev_attr_temp_virt1_input.dev_attr.attr,
+	&sensor_dev_attr_temp_virt2_input.dev_attr.attr,
+	&sensor_dev_attr_temp_virt3_input.dev_attr.attr,
+	&sensor_dev_attr_temp_virt4_input.dev_attr.attr,
+	&sensor_dev_attr_fan1_estimate.dev_attr.attr,
+	&sensor_dev_attr_fan1_estimate_stddev.dev_attr.attr,
+	&sensor_dev_attr_temp1_estimate.dev_attr.attr,
+	&sensor_dev_attr_temp1_estimate_stddev.dev_attr.attr,
+	NULL
+};
+
+ATTRIBUTE_GROUPS(oxp_ctl);
+
+static const struct hwmon_ops oxp_ec_hwmon_ops = {
+	.is_visible = oxp_ec_hwmon_is_visible,
+	.read = oxp_platform_read,
+	.read_string = oxp_platform_read_string,
+	.write = oxp_platform_write,
+};
+
+static const struct hwmon_chip_info oxp_ec_chip_info = {
+	.ops = &oxp_ec_hwmon_ops,
+	.info = oxp_platform_sensors,
+};
+
+/* Debugfs interface */
+static u64 oxp_latency_count(struct oxp_latency *lat)
+{
+	u64 count = 0;
+	int i;
+
+	for (i = 0; i < OXP_STATS_BUCKETS; i++)
+		count += atomic64_read(&lat->hist[i]);
+
+	return count;
+}
+
+/* Upper bound in us of the bucket holding the given percentile */
+static unsigned int oxp_latency_percentile(struct oxp_latency *lat, u64 count,
+					   int pct)
+{
+	u64 target = div_u64(count * pct + 99, 100);
+	u64 seen = 0;
+	int i;
+
+	for (i = 0; i < OXP_STATS_BUCKETS; i++) {
+		seen += atomic64_read(&lat->hist[i]);
+		if (seen >= target)
+			return i ? 1U << i : 1;
+	}
+	return 1U << (OXP_STATS_BUCKETS - 1);
+}
+
+/* total_base is subtracted from the total of latencies that are never reset */
+static void oxp_latency_show_since(struct seq_file *s, const char *name,
+				   struct oxp_latency *lat, s64 total_base)
+{
+	u64 count = oxp_latency_count(lat);
+	u64 total = atomic64_read(&lat->total_ns) - total_base;
+
+	if (!count)
+		return;
+
+	seq_printf(s, "%-18s %10llu %10llu %10lld %8u %8u %10llu\n", name, count,
+		   div64_u64(total, count), atomic64_read(&lat->max_ns),
+		   oxp_latency_percentile(lat, count, 50),
+		   oxp_latency_percentile(lat, count, 99),
+		   total ? div64_u64(count * NSEC_PER_SEC, total) : 0);
+}
+
+static void oxp_latency_show(struct seq_file *s, const char *name,
+			     struct oxp_latency *lat)
+{
+	oxp_latency_show_since(s, name, lat, 0);
+}
+
+static int oxp_stats_show(struct seq_file *s, void *unused)
+{
+	char name[32];
+	int i, j;
+
+	seq_printf(s, "board: %s\n", board_info->name);
+	seq_printf(s, "transport: %s\n", oxp_ec->name);
+	seq_printf(s, "timestamp_ns: %llu\n", ktime_get_ns());
+	seq_printf(s, "reset_timestamp_ns: %llu\n", READ_ONCE(oxp_stats_reset_ns));
+	seq_printf(s, "ec_reads: %lld\n", atomic64_read(&oxp_stats.reads) -
+		   READ_ONCE(oxp_stats_base.reads));
+	seq_printf(s, "ec_writes: %lld\n", atomic64_read(&oxp_stats.writes) -
+		   READ_ONCE(oxp_stats_base.writes));
+	seq_printf(s, "ec_errors: %lld\n", atomic64_read(&oxp_stats.errors));
+	seq_printf(s, "cache_hits: %lld\n", atomic64_read(&oxp_stats.cache_hits) -
+		   READ_ONCE(oxp_stats_base.cache_hits));
+	seq_printf(s, "cache_misses: %lld\n",
+		   atomic64_read(&oxp_stats.cache_misses));
+	seq_printf(s, "writes_suppressed: %lld\n",
+		   atomic64_read(&oxp_stats.writes_suppressed));
+	seq_printf(s, "sampler_ticks: %lld\n",
+		   atomic64_read(&oxp_stats.sampler_ticks));
+	seq_printf(s, "ticks_missed: %lld\n",
+		   atomic64_read(&oxp_stats.ticks_missed));
+	seq_printf(s, "ticks_coalesced: %lld\n",
+		   atomic64_read(&oxp_stats.ticks_coalesced));
+	seq_printf(s, "sample_interval_ms: %u\n", READ_ONCE(sample_interval_ms));
+	seq_printf(s, "ec_refresh_period_us: %llu\n",
+		   div_u64(READ_ONCE(oxp_cadence.period_ns), NSEC_PER_USEC));
+	for (i = 0; i < OXP_IFACE_MAX; i++) {
+		seq_printf(s, "demand_%s:", oxp_iface_names[i]);
+		for (j = 0; j < OXP_PATH_MAX; j++) {
+			if (oxp_demanded(j) &&
+			    oxp_demand_active(READ_ONCE(oxp_demand[i][j])))
+				seq_printf(s, " %s", oxp_ec_path_names[j]);
+		}
+		seq_putc(s, '\n');
+	}
+
+	/* Latencies in ns, percentiles as bucket upper bounds in us */
+	seq_printf(s, "\n%-18s %10s %10s %10s %8s %8s %10s\n", "path", "count",
+		   "avg_ns", "max_ns", "p50_us", "p99_us", "ops_per_s");
+	oxp_latency_show_since(s, "lock_wait", &oxp_stats.lock_wait,
+			       READ_ONCE(oxp_stats_base.lock_wait_ns));
+	oxp_latency_show(s, "read_batch", &oxp_stats.batch_lat);
+	oxp_latency_show(s, "tick_jitter", &oxp_stats.tick_jitter);
+	oxp_latency_show(s, "tick_duration", &oxp_stats.tick_duration);
+	for (i = 0; i < OXP_PATH_MAX; i++) {
+		snprintf(name, sizeof(name), "read_%s", oxp_ec_path_names[i]);
+		oxp_latency_show(s, name, &oxp_stats.read_lat[i]);
+	}
+	for (i = 0; i < OXP_PATH_MAX; i++) {
+		snprintf(name, sizeof(name), "write_%s", oxp_ec_path_names[i]);
+		oxp_latency_show(s, name, &oxp_stats.write_lat[i]);
+	}
+
+	/* Cost of a read through each userspace interface */
+	seq_printf(s, "\n%-18s %10s %10s %10s %8s %8s %10s\n", "interface",
+		   "reads", "avg_ns", "max_ns", "p50_us", "p99_us", "ec_per_read");
+	for (i = 0; i < OXP_IFACE_MAX; i++) {
+		struct oxp_latency *lat = &oxp_stats.iface_lat[i];
+		u64 count = oxp_latency_count(lat);
+		u64 ec = atomic64_read(&oxp_stats.iface_ec_reads[i]) * 100;
+
+		if (!count)
+			continue;
+
+		seq_printf(s, "%-18s %10llu %10llu %10lld %8u %8u %7llu.%02llu\n",
+			   oxp_iface_names[i], count,
+			   div64_u64(atomic64_read(&lat->total_ns), count),
+			   atomic64_read(&lat->max_ns),
+			   oxp_latency_percentile(lat, count, 50),
+			   oxp_latency_percentile(lat, count, 99),
+			   div64_u64(ec, count) / 100, div64_u64(ec, count) % 100);
+	}
+
+	return 0;
+}
+
+static int oxp_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, oxp_stats_show, NULL);
+}
+
+/* Any write resets the counters, to measure a workload from a clean state */
+static ssize_t oxp_stats_write(struct file *file, const char __user *ubuf,
+			       size_t count, loff_t *ppos)
+{
+	oxp_stats_reset();
+
+	return count;
+}
+
+static const struct file_operations oxp_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = oxp_stats_open,
+	.read = seq_read,
+	.write = oxp_stats_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int oxp_audit_show(struct seq_file *s, void *unused)
+{
+	u64 head = atomic64_read(&oxp_audit.head);
+	struct oxp_audit_entry *e, copy;
+	u64 seq;
+
+	seq_puts(s, "# timestamp_ns pid comm attribute old new ec latency_ns ret\n");
+	seq = head > OXP_AUDIT_SIZE ? head - OXP_AUDIT_SIZE + 1 : 1;
+	for (; seq <= head; seq++) {
+		e = &oxp_audit.ring[seq % OXP_AUDIT_SIZE];
+		if (smp_load_acquire(&e->seq) != seq)
+			continue;
+		copy = *e;
+		smp_rmb();
+		if (READ_ONCE(e->seq) != seq)
+			continue;
+
+		seq_printf(s, "%llu %d %s %s %ld %ld %ld %llu %d\n",
+			   copy.timestamp_ns, copy.pid, copy.comm,
+			   oxp_audit_attr_names[copy.attr], copy.old_val,
+			   copy.new_val, copy.ec_val, copy.latency_ns, copy.ret);
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(oxp_audit);
+
+static int oxp_watch_show(struct seq_file *s, void *unused)
+{
+	unsigned int i;
+
+	mutex_lock(&oxp_ctl_lock);
+	for (i = 0; i < oxp_watch.count; i++) {
+		if (oxp_watch.primed)
+			seq_printf(s, "0x%02x 0x%02x\n", oxp_watch.regs[i],
+				   oxp_watch.vals[i]);
+		else
+			seq_printf(s, "0x%02x -\n", oxp_watch.regs[i]);
+	}
+	mutex_unlock(&oxp_ctl_lock);
+
+	return 0;
+}
+
+static int oxp_watch_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, oxp_watch_show, NULL);
+}
+
+/* Takes a whitespace or comma separated register list, empty to clear */
+static ssize_t oxp_watch_write(struct file *file, const char __user *ubuf,
+			       size_t count, loff_t *ppos)
+{
+	u8 regs[OXP_WATCH_MAX];
+	unsigned int n = 0;
+	char *buf, *cur, *tok;
+	int ret = 0;
+
+	if (count > PAGE_SIZE)
+		return -E2BIG;
+
+	buf = memdup_user_nul(ubuf, count);
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+
+	cur = buf;
+	while ((tok = strsep(&cur, " \t\n,"))) {
+		if (!*tok)
+			continue;
+		if (n == OXP_WATCH_MAX) {
+			ret = -E2BIG;
+			break;
+		}
+		ret = kstrtou8(tok, 0, &regs[n++]);
+		if (ret)
 			break;
-		}
-		break;
-	default:
-		break;
 	}
-	return -EOPNOTSUPP;
+	kfree(buf);
+	if (ret)
+		return ret;
+
+	mutex_lock(&oxp_ctl_lock);
+	memcpy(oxp_watch.regs, regs, n);
+	oxp_watch.count = n;
+	oxp_watch.primed = false;
+	oxp_sampler_ensure();
+	mutex_unlock(&oxp_ctl_lock);
+
+	return count;
 }
 
-static int oxp_platform_write(struct device *dev, enum hwmon_sensor_types type,
-			      u32 attr, int channel, long val)
+static const struct file_operations oxp_watch_fops = {
+	.owner = THIS_MODULE,
+	.open = oxp_watch_open,
+	.read = seq_read,
+	.write = oxp_watch_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int oxp_watch_events_show(struct seq_file *s, void *unused)
 {
-	switch (type) {
-	case hwmon_pwm:
-		switch (attr) {
-		case hwmon_pwm_enable:
-			if (val == 1)
-				return oxp_pwm_enable();
-			else if (val == 0)
-				return oxp_pwm_disable();
-			return -EINVAL;
-		case hwmon_pwm_input:
-			if (val < 0 || val > 255)
-				return -EINVAL;
-			switch (board) {
-			case aya_neo_2:
-			case aya_neo_air:
-			case aya_neo_air_pro:
-			case aya_neo_geek:
-			case oxp_mini_amd:
-			case oxp_mini_amd_a07:
-				val = (val * 100) / 255;
-				break;
-			case aok_zoe_a1:
-			case oxp_mini_amd_pro:
-			default:
-				break;
-			}
-			return write_to_ec(OXP_SENSOR_PWM_REG, val);
-		default:
-			break;
-		}
-		break;
+	struct oxp_watch_event *e;
+	u64 seq;
+
+	seq_puts(s, "# timestamp_ns reg old new\n");
+	mutex_lock(&oxp_ctl_lock);
+	seq = oxp_watch.head > OXP_WATCH_EVENTS ?
+	      oxp_watch.head - OXP_WATCH_EVENTS : 0;
+	for (; seq < oxp_watch.head; seq++) {
+		e = &oxp_watch.ring[seq % OXP_WATCH_EVENTS];
+		seq_printf(s, "%llu 0x%02x 0x%02x 0x%02x\n", e->timestamp_ns,
+			   e->reg, e->old_val, e->new_val);
+	}
+	mutex_unlock(&oxp_ctl_lock);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(oxp_watch_events);
+
+/* Times a burst of byte reads through the active transport */
+#define OXP_BENCH_BYTES	64
+
+static int oxp_bench_show(struct seq_file *s, void *unused)
+{
+	u64 start, ns;
+	int ret = 0;
+	int i;
+	u8 val;
+
+	if (!lock_global_acpi_lock())
+		return -EBUSY;
+
+	start = ktime_get_ns();
+	for (i = 0; i < OXP_BENCH_BYTES && !ret; i++)
+		ret = oxp_ec->read(OXP_SENSOR_FAN_REG + (i & 1), &val);
+	ns = ktime_get_ns() - start;
+
+	unlock_global_acpi_lock();
+	atomic64_add(i, &oxp_stats.reads);
+	if (ret)
+		return ret;
+
+	seq_printf(s, "transport: %s\n", oxp_ec->name);
+	seq_printf(s, "bytes: %d\n", OXP_BENCH_BYTES);
+	seq_printf(s, "ns: %llu\n", ns);
+	seq_printf(s, "bytes_per_s: %llu\n",
+		   ns ? div64_u64(OXP_BENCH_BYTES * NSEC_PER_SEC, ns) : 0);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(oxp_bench);
+
+/* The history is copied at open so it can be streamed consistently */
+struct oxp_hist_snapshot {
+	size_t size;
+	u8 data[];
+};
+
+static int oxp_history_open(struct inode *inode, struct file *file)
+{
+	struct oxp_hist_snapshot *snap;
+	unsigned int i, idx;
+	size_t bsize = sizeof(struct oxp_hist_block);
+
+	mutex_lock(&oxp_hist_lock);
+	snap = kvzalloc(struct_size(snap, data, oxp_hist.used * bsize), GFP_KERNEL);
+	if (!snap) {
+		mutex_unlock(&oxp_hist_lock);
+		return -ENOMEM;
+	}
+
+	snap->size = oxp_hist.used * bsize;
+	for (i = 0; i < oxp_hist.used; i++) {
+		idx = (oxp_hist.head + oxp_hist.count - oxp_hist.used + 1 + i) %
+		      oxp_hist.count;
+		memcpy(&snap->data[i * bsize], &oxp_hist.blocks[idx], bsize);
+	}
+	mutex_unlock(&oxp_hist_lock);
+
+	file->private_data = snap;
+
+	return 0;
+}
+
+static ssize_t oxp_history_read(struct file *file, char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct oxp_hist_snapshot *snap = file->private_data;
+
+	return simple_read_from_buffer(buf, count, ppos, snap->data, snap->size);
+}
+
+static int oxp_history_release(struct inode *inode, struct file *file)
+{
+	kvfree(file->private_data);
+
+	return 0;
+}
+
+static const struct file_operations oxp_history_fops = {
+	.owner = THIS_MODULE,
+	.open = oxp_history_open,
+	.read = oxp_history_read,
+	.llseek = default_llseek,
+	.release = oxp_history_release,
+};
+
+static void oxp_debugfs_remove(void *data)
+{
+	debugfs_remove_recursive(data);
+}
+
+static int oxp_debugfs_init(struct device *dev)
+{
+	struct dentry *dir;
+
+	dir = debugfs_create_dir("oxp-sensors", NULL);
+	debugfs_create_file("stats", 0644, dir, NULL, &oxp_stats_fops);
+	debugfs_create_file("audit", 0444, dir, NULL, &oxp_audit_fops);
+	debugfs_create_file("bench", 0400, dir, NULL, &oxp_bench_fops);
+	debugfs_create_file("watch", 0600, dir, NULL, &oxp_watch_fops);
+	debugfs_create_file("watch_events", 0400, dir, NULL,
+			    &oxp_watch_events_fops);
+	if (oxp_hist.blocks)
+		debugfs_create_file("history", 0400, dir, NULL,
+				    &oxp_history_fops);
+
+	return devm_add_action_or_reset(dev, oxp_debugfs_remove, dir);
+}
+
+/*
+ * Perf PMU
+ * The EC counters are also exported as a counting-only "oxp" PMU, so they
+ * can be read with perf stat -a next to other events. The counters are
+ * global, so the PMU advertises a single CPU to avoid counting them once
+ * per CPU.
+ */
+#ifdef CONFIG_PERF_EVENTS
+enum oxp_pmu_event {
+	OXP_PMU_EC_READS,
+	OXP_PMU_EC_WRITES,
+	OXP_PMU_LOCK_WAIT_NS,
+	OXP_PMU_CACHE_HITS,
+	OXP_PMU_MAX,
+};
+
+static u64 oxp_pmu_read_counter(struct perf_event *event)
+{
+	switch (event->hw.config) {
+	case OXP_PMU_EC_READS:
+		return atomic64_read(&oxp_stats.reads);
+	case OXP_PMU_EC_WRITES:
+		return atomic64_read(&oxp_stats.writes);
+	case OXP_PMU_LOCK_WAIT_NS:
+		return atomic64_read(&oxp_stats.lock_wait.total_ns);
+	case OXP_PMU_CACHE_HITS:
+		return atomic64_read(&oxp_stats.cache_hits);
 	default:
-		break;
+		return 0;
 	}
-	return -EOPNOTSUPP;
 }
 
-/* Known sensors in the OXP EC controllers */
-static const struct hwmon_channel_info * const oxp_platform_sensors[] = {
-	HWMON_CHANNEL_INFO(fan,
-			   HWMON_F_INPUT),
-	HWMON_CHANNEL_INFO(pwm,
-			   HWMON_PWM_INPUT | HWMON_PWM_ENABLE),
-	NULL,
+static int oxp_pmu_event_init(struct perf_event *event)
+{
+	if (event->attr.type != event->pmu->type)
+		return -ENOENT;
+
+	if (is_sampling_event(event) || event->cpu < 0)
+		return -EINVAL;
+
+	if (event->attr.config >= OXP_PMU_MAX)
+		return -EINVAL;
+
+	event->hw.config = event->attr.config;
+
+	return 0;
+}
+
+static void oxp_pmu_event_update(struct perf_event *event)
+{
+	u64 prev = local64_read(&event->hw.prev_count);
+	u64 now;
+
+	do {
+		now = oxp_pmu_read_counter(event);
+	} while (!local64_try_cmpxchg(&event->hw.prev_count, &prev, now));
+
+	local64_add(now - prev, &event->count);
+}
+
+static void oxp_pmu_event_start(struct perf_event *event, int flags)
+{
+	local64_set(&event->hw.prev_count, oxp_pmu_read_counter(event));
+}
+
+static void oxp_pmu_event_stop(struct perf_event *event, int flags)
+{
+	oxp_pmu_event_update(event);
+}
+
+static int oxp_pmu_event_add(struct perf_event *event, int flags)
+{
+	if (flags & PERF_EF_START)
+		oxp_pmu_event_start(event, flags);
+
+	return 0;
+}
+
+static void oxp_pmu_event_del(struct perf_event *event, int flags)
+{
+	oxp_pmu_event_stop(event, PERF_EF_UPDATE);
+}
+
+static ssize_t cpumask_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	return sysfs_emit(buf, "0\n");
+}
+
+static DEVICE_ATTR_RO(cpumask);
+
+static struct attribute *oxp_pmu_cpumask_attrs[] = {
+	&dev_attr_cpumask.attr,
+	NULL
 };
 
-static struct attribute *oxp_ec_attrs[] = {
-	&dev_attr_tt_toggle.attr,
+static const struct attribute_group oxp_pmu_cpumask_group = {
+	.attrs = oxp_pmu_cpumask_attrs,
+};
+
+PMU_FORMAT_ATTR(event, "config:0-7");
+
+static struct attribute *oxp_pmu_format_attrs[] = {
+	&format_attr_event.attr,
 	NULL
 };
 
-ATTRIBUTE_GROUPS(oxp_ec);
+static const struct attribute_group oxp_pmu_format_group = {
+	.name = "format",
+	.attrs = oxp_pmu_format_attrs,
+};
 
-static const struct hwmon_ops oxp_ec_hwmon_ops = {
-	.is_visible = oxp_ec_hwmon_is_visible,
-	.read = oxp_platform_read,
-	.write = oxp_platform_write,
+PMU_EVENT_ATTR_STRING(ec_reads, oxp_pmu_ec_reads, "event=0x00");
+PMU_EVENT_ATTR_STRING(ec_writes, oxp_pmu_ec_writes, "event=0x01");
+PMU_EVENT_ATTR_STRING(lock_wait_ns, oxp_pmu_lock_wait_ns, "event=0x02");
+PMU_EVENT_ATTR_STRING(lock_wait_ns.unit, oxp_pmu_lock_wait_ns_unit, "ns");
+PMU_EVENT_ATTR_STRING(cache_hits, oxp_pmu_cache_hits, "event=0x03");
+
+static struct attribute *oxp_pmu_event_attrs[] = {
+	&oxp_pmu_ec_reads.attr.attr,
+	&oxp_pmu_ec_writes.attr.attr,
+	&oxp_pmu_lock_wait_ns.attr.attr,
+	&oxp_pmu_lock_wait_ns_unit.attr.attr,
+	&oxp_pmu_cache_hits.attr.attr,
+	NULL
 };
 
-static const struct hwmon_chip_info oxp_ec_chip_info = {
-	.ops = &oxp_ec_hwmon_ops,
-	.info = oxp_platform_sensors,
+static const struct attribute_group oxp_pmu_event_group = {
+	.name = "events",
+	.attrs = oxp_pmu_event_attrs,
+};
+
+static const struct attribute_group *oxp_pmu_attr_groups[] = {
+	&oxp_pmu_cpumask_group,
+	&oxp_pmu_format_group,
+	&oxp_pmu_event_group,
+	NULL
 };
 
+static struct pmu oxp_pmu = {
+	.module = THIS_MODULE,
+	.task_ctx_nr = perf_invalid_context,
+	.attr_groups = oxp_pmu_attr_groups,
+	.event_init = oxp_pmu_event_init,
+	.add = oxp_pmu_event_add,
+	.del = oxp_pmu_event_del,
+	.start = oxp_pmu_event_start,
+	.stop = oxp_pmu_event_stop,
+	.read = oxp_pmu_event_update,
+	.capabilities = PERF_PMU_CAP_NO_INTERRUPT | PERF_PMU_CAP_NO_EXCLUDE,
+};
+
+static void oxp_pmu_remove(void *data)
+{
+	perf_pmu_unregister(&oxp_pmu);
+}
+
+static int oxp_pmu_init(struct device *dev)
+{
+	int ret;
+
+	/* The PMU is optional, the driver works without it */
+	ret = perf_pmu_register(&oxp_pmu, "oxp", -1);
+	if (ret) {
+		dev_warn(dev, "failed to register perf PMU: %d\n", ret);
+		return 0;
+	}
+
+	return devm_add_action_or_reset(dev, oxp_pmu_remove, NULL);
+}
+#else
+static int oxp_pmu_init(struct device *dev)
+{
+	return 0;
+}
+#endif
+
 /* Initialization logic */
+
+/*
+ * The device state is file static and outlives the device when its board
+ * module is unloaded and loaded again, so every probe starts from the
+ * defaults rather than re-applying the policies of the previous device.
+ * Statistics and the audit log are kept, they describe the module.
+ */
+static void oxp_state_reset(void)
+{
+	spin_lock(&oxp_cache_lock);
+	memset(oxp_cache, 0, sizeof(oxp_cache));
+	spin_unlock(&oxp_cache_lock);
+	memset(oxp_mock_ram, 0, sizeof(oxp_mock_ram));
+	oxp_mock_fan_ns = 0;
+	memset(oxp_demand, 0, sizeof(oxp_demand));
+
+	mutex_lock(&oxp_ctl_lock);
+	memset(&oxp_cadence, 0, sizeof(oxp_cadence));
+	/* Detect on the first tick */
+	oxp_cadence.ticks = OXP_CADENCE_REDETECT_TICKS;
+
+	memset(&oxp_ctl, 0, sizeof(oxp_ctl));
+	oxp_ctl.pwm_request = -1;
+	oxp_ctl.ceiling = INT_MAX;
+
+	memset(&oxp_budget, 0, sizeof(oxp_budget));
+	oxp_budget.size = OXP_BUDGET_DEF_SIZE;
+	oxp_budget.pwm_min = OXP_BUDGET_DEF_PWM_MIN;
+	oxp_budget.pwm_max = OXP_BUDGET_DEF_PWM_MAX;
+
+	memset(&oxp_ff, 0, sizeof(oxp_ff));
+	memset(&oxp_watch, 0, sizeof(oxp_watch));
+	oxp_notified.rpm = -1;
+	oxp_notified.pwm = -1;
+	oxp_sampler_due_ns = 0;
+	oxp_sampler_regular_ns = 0;
+	mutex_unlock(&oxp_ctl_lock);
+
+	spin_lock(&oxp_est_lock);
+	memset(&oxp_est, 0, sizeof(oxp_est));
+	spin_unlock(&oxp_est_lock);
+
+	spin_lock(&oxp_virt_lock);
+	memset(oxp_virt_temps, 0, sizeof(oxp_virt_temps));
+	spin_unlock(&oxp_virt_lock);
+}
+
 static int oxp_platform_probe(struct platform_device *pdev)
 {
-	const struct dmi_system_id *dmi_entry;
 	struct device *dev = &pdev->dev;
 	struct device *hwdev;
 	int ret;
 
-	/*
-	 * Have to check for AMD processor here because DMI strings are the
-	 * same between Intel and AMD boards, the only way to tell them apart
-	 * is the CPU.
-	 * Intel boards seem to have different EC registers and values to
-	 * read/write.
-	 */
-	dmi_entry = dmi_first_match(dmi_table);
-	if (!dmi_entry || boot_cpu_data.x86_vendor != X86_VENDOR_AMD)
-		return -ENODEV;
+	board_info = *(const struct oxp_board_info **)dev_get_platdata(dev);
+	oxp_state_reset();
 
-	board = (enum oxp_board)(unsigned long)dmi_entry->driver_data;
+	ret = oxp_transport_init(dev);
+	if (ret)
+		return ret;
 
-	switch (board) {
-	case aok_zoe_a1:
-	case oxp_mini_amd_a07:
-	case oxp_mini_amd_pro:
+	if (board_info->turbo_reg) {
 		ret = devm_device_add_groups(dev, oxp_ec_groups);
 		if (ret)
 			return ret;
-		break;
-	default:
-		break;
 	}
 
+	ret = oxp_fused_parse();
+	if (ret)
+		return ret;
+
+	ret = oxp_history_init(dev);
+	if (ret)
+		return ret;
+
+	ret = oxp_debugfs_init(dev);
+	if (ret)
+		return ret;
+
+	ret = oxp_pmu_init(dev);
+	if (ret)
+		return ret;
+
+	ret = oxp_sampler_init(dev);
+	if (ret)
+		return ret;
+
+	ret = devm_add_action_or_reset(dev, oxp_sampler_stop, NULL);
+	if (ret)
+		return ret;
+
+	ret = oxp_restore_init(dev);
+	if (ret)
+		return ret;
+
+	mutex_lock(&oxp_ctl_lock);
+	oxp_sampler_ensure();
+	mutex_unlock(&oxp_ctl_lock);
+
 	hwdev = devm_hwmon_device_register_with_info(dev, "oxpec", NULL,
-						     &oxp_ec_chip_info, NULL);
+						     &oxp_ec_chip_info,
+						     oxp_ctl_groups);
+	if (IS_ERR(hwdev))
+		return PTR_ERR(hwdev);
+
+	mutex_lock(&oxp_ctl_lock);
+	oxp_hwmon_dev = hwdev;
+	mutex_unlock(&oxp_ctl_lock);
 
-	return PTR_ERR_OR_ZERO(hwdev);
+	return devm_add_action_or_reset(dev, oxp_hwmon_unpublish, NULL);
 }
 
 static struct platform_driver oxp_platform_driver = {
 	.driver = {
 		.name = "oxp-platform",
+		.suppress_bind_attrs = true,
 	},
 	.probe = oxp_platform_probe,
 };
 
+/*
+ * Board module interface
+ * The EC core drives a single device. The first board family that matches
+ * the machine, or that contains mock_board when the mock transport is
+ * selected, creates it; later families fail with -EBUSY.
+ */
+static DEFINE_MUTEX(oxp_family_lock);
+static const struct oxp_board_family *oxp_family;
 static struct platform_device *oxp_platform_device;
 
-static int __init oxp_platform_init(void)
+static const struct oxp_board_info *
+oxp_board_detect(const struct oxp_board_family *family)
 {
-	oxp_platform_device =
-		platform_create_bundle(&oxp_platform_driver,
-				       oxp_platform_probe, NULL, 0, NULL, 0);
+	const struct dmi_system_id *dmi_entry;
+	unsigned long idx;
+	unsigned int i;
+
+	if (sysfs_streq(ec_transport, oxp_transports[OXP_TRANSPORT_MOCK].name)) {
+		for (i = 0; i < family->nr_boards; i++) {
+			if (sysfs_streq(mock_board, family->boards[i].name))
+				return &family->boards[i];
+		}
+		return NULL;
+	}
+
+	/*
+	 * Have to check for AMD processor here because DMI strings are the
+	 * same between Intel and AMD boards, the only way to tell them apart
+	 * is the CPU.
+	 * Intel boards seem to have different EC registers and values to
+	 * read/write.
+	 */
+	dmi_entry = dmi_first_match(family->dmi_table);
+	if (!dmi_entry || boot_cpu_data.x86_vendor != X86_VENDOR_AMD)
+		return NULL;
+
+	idx = (unsigned long)dmi_entry->driver_data;
+	if (idx >= family->nr_boards)
+		return NULL;
 
-	return PTR_ERR_OR_ZERO(oxp_platform_device);
+	return &family->boards[idx];
 }
 
-static void __exit oxp_platform_exit(void)
+int oxp_ec_register_family(const struct oxp_board_family *family)
 {
-	platform_device_unregister(oxp_platform_device);
-	platform_driver_unregister(&oxp_platform_driver);
+	const struct oxp_board_info *board;
+	struct platform_device *pdev;
+	int ret = 0;
+
+	board = oxp_board_detect(family);
+	if (!board)
+		return -ENODEV;
+
+	mutex_lock(&oxp_family_lock);
+	if (oxp_family) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	pdev = platform_device_register_data(NULL, oxp_platform_driver.driver.name,
+					     PLATFORM_DEVID_NONE, &board,
+					     sizeof(board));
+	if (IS_ERR(pdev)) {
+		ret = PTR_ERR(pdev);
+		goto out;
+	}
+
+	/* A failed probe fails the board module load */
+	if (!pdev->dev.driver) {
+		platform_device_unregister(pdev);
+		board_info = NULL;
+		ret = -ENODEV;
+		goto out;
+	}
+
+	oxp_platform_device = pdev;
+	oxp_family = family;
+out:
+	mutex_unlock(&oxp_family_lock);
+
+	return ret;
 }
+EXPORT_SYMBOL_GPL(oxp_ec_register_family);
 
-MODULE_DEVICE_TABLE(dmi, dmi_table);
+void oxp_ec_unregister_family(const struct oxp_board_family *family)
+{
+	mutex_lock(&oxp_family_lock);
+	if (oxp_family == family) {
+		platform_device_unregister(oxp_platform_device);
+		oxp_platform_device = NULL;
+		oxp_family = NULL;
+		board_info = NULL;
+	}
+	mutex_unlock(&oxp_family_lock);
+}
+EXPORT_SYMBOL_GPL(oxp_ec_unregister_family);
 
-module_init(oxp_platform_init);
-module_exit(oxp_platform_exit);
+module_platform_driver(oxp_platform_driver);
 
 MODULE_AUTHOR("Joaquín Ignacio Aramendía <samsagax@gmail.com>");
-MODULE_DESCRIPTION("Platform driver that handles EC sensors of OneXPlayer devices");
+MODULE_DESCRIPTION("EC core of the OneXPlayer, AOK ZOE and Aya Neo sensor drivers");
 MODULE_LICENSE("GPL");